@@ -3,11 +3,26 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <cstdint>
 
 namespace cpp_arg_parser {
 
 struct option;
+struct option_group;
 struct verb;
+class schema_blob;
+
+enum class CriteriaTypes {
+    Criteria_custom = 1, Criteria_type, Criteria_number_list, Criteria_range, Criteria_number_range, Criteria_one_of_string
+};
+
+// flattened form of a test criteria, as stored in a schema blob
+struct criteria_data {
+    CriteriaTypes type;
+    int32_t param = 0;
+    std::vector<int32_t> ints;
+    std::vector<std::string> strings;
+};
 
 /* -------------------------------------------------------------------------- */
 /*                                TestCriteria                                */
@@ -22,6 +37,7 @@ public:
 
     virtual std::string toString() = 0;
     virtual void check(const std::string &value) = 0;
+    virtual bool serialize(criteria_data &) { return false; }
 };
 
 class custom_test_criteria : public test_criteria_base {
@@ -34,6 +50,7 @@ public:
 
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
 };
 custom_test_criteria &createCustom(const std::string &errorMsg, const std::string &desc, bool (*evalFnPtr)(const std::string&));
 
@@ -50,6 +67,7 @@ public:
 
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
 };
 type_test_criteria &createTypeTest(TestTypes type);
 
@@ -60,6 +78,7 @@ private:
 public:
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
     number_list_test_criteria &add(int number);
 };
 number_list_test_criteria &createNumberList(const std::string &optionName);
@@ -72,6 +91,7 @@ public:
 
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
 };
 range_test_criteria &createRange(int start, int end);
 
@@ -83,6 +103,7 @@ private:
 public:
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
     number_range_test_criteria &add(int number);
     number_range_test_criteria &addRange(int start, int end);
 };
@@ -98,58 +119,176 @@ public:
 
     std::string toString();
     void check(const std::string &value);
+    bool serialize(criteria_data &data);
     one_of_string_test_criteria &add(const std::string &possibility);
 };
 one_of_string_test_criteria &createOneOfString(bool matchCase);
 
+/* -------------------------------------------------------------------------- */
+/*                                 Constraints                                */
+/* -------------------------------------------------------------------------- */
+enum class ConstraintTypes {
+    Constraint_mutually_exclusive = 1, Constraint_at_least_one, Constraint_requires
+};
+
+// flattened form of a constraint, as stored in a schema blob
+struct constraint_data {
+    ConstraintTypes type;
+    std::vector<std::string> names;
+};
+
+// Constraints between the options of a verb, checked against the bitset of
+// present option ids. Option names are resolved on the first check.
+class constraint_base {
+protected:
+    struct mask_word {
+        size_t index;
+        uint64_t bits;
+    };
+    bool resolved = false, inheritedResolved = false, inherited = false;
+    std::vector<std::string> names;
+    std::vector<mask_word> mask;
+
+    void resolve(std::vector<mask_word> &words, size_t first, size_t last);
+    void addName(const std::string &fullName);
+    size_t countPresent(const std::vector<uint64_t> &presence, const std::vector<mask_word> &words);
+    std::string namesToString(size_t first = 0);
+
+public:
+    verb *parent = nullptr;
+
+    virtual ~constraint_base() {}
+
+    void error(const std::string &msg);
+    bool isInherited();
+
+    virtual std::string toString() = 0;
+    virtual void check(const std::vector<uint64_t> &presence) = 0;
+    virtual void serialize(constraint_data &data) = 0;
+};
+
+class mutually_exclusive_constraint : public constraint_base {
+public:
+    std::string toString();
+    void check(const std::vector<uint64_t> &presence);
+    void serialize(constraint_data &data);
+    mutually_exclusive_constraint &add(const std::string &fullName);
+};
+mutually_exclusive_constraint &createMutuallyExclusive();
+
+class at_least_one_constraint : public constraint_base {
+public:
+    std::string toString();
+    void check(const std::vector<uint64_t> &presence);
+    void serialize(constraint_data &data);
+    at_least_one_constraint &add(const std::string &fullName);
+};
+at_least_one_constraint &createAtLeastOne();
+
+// when the first option is present, all of the added options must be too
+class requires_constraint : public constraint_base {
+private:
+    std::vector<mask_word> trigger;
+
+public:
+    requires_constraint(const std::string &fullName);
+
+    std::string toString();
+    void check(const std::vector<uint64_t> &presence);
+    void serialize(constraint_data &data);
+    requires_constraint &add(const std::string &fullName);
+};
+requires_constraint &createRequires(const std::string &fullName);
+
 /* -------------------------------------------------------------------------- */
 /*                                   Options                                  */
 /* -------------------------------------------------------------------------- */
 struct option {
-    bool expectsValue, isPresent, valueRequired, required;
+    bool expectsValue, isPresent, valueRequired, required, inherited = false;
+    bool hasDefault = false, lazyDefault = false;
     char chrName;
-    verb *parent;
+    uint32_t id, order = 0;
+    verb *parent = nullptr;          // the verb the option was added to, nullptr for options in a group
     void (*actionFn)(option *) = nullptr;
-    std::string desc, fullName, value;
+    // a lazy default is computed on first access and then kept in defaultValue
+    std::string (*defaultFn)() = nullptr;
+    std::string desc, fullName, value, defaultValue, defaultDesc;
     std::vector<test_criteria_base*> testCriteria;
 
     option(const std::string &fullName, const char chrName, const std::string &desc, bool expectsValue, bool required);
 
     option &addAction(void (*action)(option *));
+    option &setInherited(bool inherited = true);
+    option &setDefault(const std::string &value);
+    option &setDefault(std::string (*defaultFn)(), const std::string &defaultDesc);
     option &addTestCriteria(test_criteria_base &test);
+    const std::string &getDefault();
     void check();
     void clear();
     void runAction();
     void printHelp();
     void printCriteria();
+    uint64_t fingerprint(uint64_t hash);
 };
 
 option &createOption(const std::string &fullName, const char chrName, const std::string &desc, bool expectsValue, bool required);
 
+/* -------------------------------------------------------------------------- */
+/*                                Option groups                               */
+/* -------------------------------------------------------------------------- */
+// A set of options that can be attached to many verbs by reference. The group
+// is deleted along with the last verb it was added to.
+struct option_group {
+    int refs = 0;
+    std::string name;
+    std::map<std::string, option*, std::less<>> optionsMap;
+    std::vector<option*> options, requiredOptions;
+
+    option_group(const std::string &name);
+
+    option_group &addOption(option &opt);
+    void release();
+    void printHelp();
+    uint64_t fingerprint(uint64_t hash);
+};
+
+option_group &createOptionGroup(const std::string &name);
+
 /* -------------------------------------------------------------------------- */
 /*                                    Verbs                                   */
 /* -------------------------------------------------------------------------- */
 struct verb {
-    bool isPresent;
-    void (*actionFn)(verb *);
-    verb *parent;
+    bool isPresent, passThrough = false;
+    void (*actionFn)(verb *) = nullptr;
+    verb *parent = nullptr;
+    schema_blob *blob = nullptr;
+    uint32_t blobIndex = 0;
     std::string name, desc;
-    std::map<std::string, verb*> verbsMap;
-    std::map<std::string, option*> optionsMap;
+    std::map<std::string, verb*, std::less<>> verbsMap;
+    std::map<std::string, option*, std::less<>> optionsMap;
     std::vector<verb*> verbs;
-    std::vector<option*> options;
+    std::vector<option*> options, requiredOptions;
+    std::vector<constraint_base*> constraints;
+    std::vector<option_group*> groups;
 
     verb(const std::string name, const std::string desc);
 
     verb &addAction(void (*action)(verb *));
     verb &addOption(option &opt);
+    verb &addOptionGroup(option_group &group);
     verb &addVerb(verb &v);
+    verb &addConstraint(constraint_base &c);
+    verb &setPassThrough(bool passThrough = true);
 
+    option *findOption(const char *name);
+    option *findOption(const std::string &name);
+    void load();
     void reset();
     void clear();
     void runAction();
     void printHelp();
     void printVerbs(std::string prefix = "", bool isLast = true);
+    uint64_t fingerprint(uint64_t hash);
 };
 
 verb &createVerb(const std::string &name, const std::string &desc);
@@ -160,22 +299,170 @@ verb &createVerb(const std::string &name, const std::string &desc);
 void error(const std::string msg);
 void error(const std::string format, const std::string msg);
 
+// Ends the parse with an exit status. Within parseStream this unwinds to the
+// record being parsed as a parse_exit, otherwise the process exits.
+struct parse_exit {
+    int status;
+};
+void finish(int status);
+
 /* -------------------------------------------------------------------------- */
 /*                                 getFullName                                */
 /* -------------------------------------------------------------------------- */
 std::string getFullName(const char chrName);
 std::string getFullName(const std::string &fullName);
 
+/* -------------------------------------------------------------------------- */
+/*                                   Events                                   */
+/* -------------------------------------------------------------------------- */
+enum class EventTypes {
+    Event_verb, Event_option, Event_positional, Event_escape, Event_help, Event_pass_through, Event_error
+};
+
+struct parse_event {
+    EventTypes type;
+    verb *v = nullptr;               // the verb entered, or the verb the option belongs to
+    option *opt = nullptr;
+    const char *value = nullptr;     // points into argv
+    const char *message = nullptr;   // set for errors
+    char **args = nullptr;           // the arguments passed through
+    int count = 0;
+};
+
+// Yields the arguments one at a time without changing the state of the
+// options or running actions. Validation beyond recognising the verbs and
+// options is left to the caller.
+class event_reader {
+private:
+    int argc, index;
+    char **argv;
+    verb *selected;
+    bool inVerbs, done;
+    std::string delimiter;
+
+    bool fail(parse_event &event, const char *message);
+    bool passThrough(parse_event &event, int first);
+
+public:
+    event_reader(verb *root, const int argc, char **argv, const std::string &delimiter = "");
+
+    bool next(parse_event &event);
+    verb *current();
+};
+
+/* -------------------------------------------------------------------------- */
+/*                                    Shell                                   */
+/* -------------------------------------------------------------------------- */
+// The state after a token of a line, which is enough to continue from it
+struct line_token {
+    size_t start, end;               // the span of the token in the line
+    verb *v;
+    option *pending = nullptr;       // an option still waiting for its value
+    bool inVerbs, escaped = false, passThrough = false;
+    size_t seenCount;                // options given up to and including this token
+    const char *message = nullptr;   // the first error on the line
+};
+
+// Checks a command line as it is typed. Only the tokens after the first
+// changed character are analysed again, and hints are read from the verb and
+// option maps. Like event_reader, option values are not checked against
+// their criteria and the options are left unchanged.
+class line_analyser {
+private:
+    verb *root;
+    std::string line, delimiter;
+    std::vector<std::string> words;
+    std::vector<line_token> tokens;
+    std::vector<option*> seen;
+
+    line_token initial();
+    void step(line_token &state, const std::string &word);
+    void addOptionHints(verb *v, const std::string &prefix, size_t seenCount, std::vector<std::string> &hints);
+
+public:
+    line_analyser(verb *root, const std::string &delimiter = "");
+
+    void update(const std::string &line);
+    const std::vector<std::string> &args();
+    const char *message(size_t &position);
+    verb *current();
+    void hints(std::vector<std::string> &hints);
+};
+
+/* -------------------------------------------------------------------------- */
+/*                                 Schema blob                                */
+/* -------------------------------------------------------------------------- */
+class schema_blob {
+private:
+    char *data;
+    size_t size;
+    std::map<std::string, bool (*)(const std::string&)> customFns;
+    std::map<std::string, void (*)(verb *)> verbActions;
+    std::map<std::string, void (*)(option *)> optionActions;
+    std::map<std::string, std::string (*)()> defaultFns;
+    std::vector<option_group*> groups;
+
+    const char *string(uint32_t offset);
+    option &createOption(uint32_t index, const std::string &path);
+    test_criteria_base *createCriteria(uint32_t index, const std::string &optionKey);
+    constraint_base *createConstraint(uint32_t index);
+
+public:
+    schema_blob(const std::string &path);
+    ~schema_blob();
+
+    void bindCustom(const std::string &desc, bool (*evalFnPtr)(const std::string&));
+    void bindCustom(const std::string &verbPath, const std::string &fullName, const std::string &desc, bool (*evalFnPtr)(const std::string&));
+    void bindAction(const std::string &verbPath, void (*action)(verb *));
+    void bindAction(const std::string &verbPath, const std::string &fullName, void (*action)(option *));
+    void bindDefault(const std::string &verbPath, const std::string &fullName, std::string (*defaultFn)());
+
+    void load(verb &v);
+    std::string programName();
+    std::string header();
+    std::string footer();
+    std::string passThroughDelimiter();
+    uint64_t fingerprint();
+
+    static void write(const std::string &path, verb &root, const std::string &programName,
+        const std::string &header, const std::string &footer, const std::string &passThroughDelimiter, uint64_t fingerprint);
+};
+
 /* -------------------------------------------------------------------------- */
 /*                                  arg_parser                                */
 /* -------------------------------------------------------------------------- */
+struct validation_cache_entry;
+
 class arg_parser {
 private:
     bool autoPrintHelp;
-    std::string programName, header, footer;
-    std::vector<std::string> after, verbPatternStr;
+    std::string programName, header, footer, cacheDir, nameBuffer, passThroughDelimiter;
+    std::vector<const char*> after;
+    char **passThroughArgv = nullptr;
+    int passThroughCount = 0;
     std::vector<verb*> verbPattern;
+    std::vector<option*> touched;
+    std::vector<char> argFlags;
+    std::vector<uint64_t> presence;
+    std::istringstream valueStream;
     verb *root, *selected;
+    schema_blob *blob = nullptr;
+    validation_cache_entry *cacheEntries = nullptr;
+    size_t cacheSize = 0;
+    uint64_t schemaHash = 0, schemaVersion = 0;
+
+    void openCache();
+    void closeCache();
+    uint64_t schemaFingerprint();
+    uint64_t cacheKey(const int argc, char **argv);
+    int lookupCache(uint64_t key, const int argc, char **argv, uint16_t *path);
+    void storeCache(uint64_t key, int verbCount);
+    const std::string &optionName(const char chrName);
+    const std::string &optionName(const std::string &fullName);
+    void handleRequest(int client, void (*requestFn)(arg_parser *));
+    int runCommand(const std::vector<std::string> &args, void (*commandFn)(arg_parser *));
+    void checkHelp(const char *arg);
+    void setPassThrough(char **argv, int first, int argc);
 
 public:
     arg_parser(bool autoPrintHelp = false);
@@ -186,31 +473,57 @@ public:
     arg_parser &setProgramName(const std::string &programName);
     arg_parser &setHelpHeader(const std::string &header);
     arg_parser &setHelpFooter(const std::string &footer);
+    arg_parser &setValidationCache(const std::string &cacheDir, uint64_t schemaVersion = 0);
+    arg_parser &setPassThroughDelimiter(const std::string &delimiter);
     arg_parser &addOption(option &o);
     arg_parser &addVerb(verb &v);
+    arg_parser &addOptionGroup(option_group &group);
+    arg_parser &addConstraint(constraint_base &c);
+
+    void writeSchema(const std::string &path);
+    arg_parser &loadSchema(const std::string &path);
+    // verbs are named by their path from the root, such as "remote add", and
+    // the options without a verb path belong to the root
+    arg_parser &bindCustom(const std::string &desc, bool (*evalFnPtr)(const std::string&));
+    arg_parser &bindCustom(const std::string &verbPath, const std::string &fullName, const std::string &desc, bool (*evalFnPtr)(const std::string&));
+    arg_parser &bindVerbAction(const std::string &verbPath, void (*action)(verb *));
+    arg_parser &bindOptionAction(const std::string &fullName, void (*action)(option *));
+    arg_parser &bindOptionAction(const std::string &verbPath, const std::string &fullName, void (*action)(option *));
+    arg_parser &bindOptionDefault(const std::string &fullName, std::string (*defaultFn)());
+    arg_parser &bindOptionDefault(const std::string &verbPath, const std::string &fullName, std::string (*defaultFn)());
 
     void parse(const int argc, char **argv);
+    int parseStream(int fd, char delim = '\0', void (*recordFn)(arg_parser *) = nullptr);
+    void serve(const std::string &socketPath, void (*requestFn)(arg_parser *) = nullptr);
+    void shell(const std::string &prompt, void (*commandFn)(arg_parser *) = nullptr);
+    event_reader events(const int argc, char **argv);
+    line_analyser analyser();
     bool isPresent(const char chrName);
     bool isPresent(const std::string &fullName);
     bool verbPresent(const std::string &name);
 
-    std::string getString(const char chrName);
-    std::string getString(const std::string &fullName);
+    // the unrecognised arguments of a pass through verb, or those after the
+    // delimiter. points into argv, so is NULL terminated when argv is
+    char **getPassThrough();
+    int getPassThroughCount();
+
+    const std::string &getString(const char chrName);
+    const std::string &getString(const std::string &fullName);
 
     template<typename T>
     T get(const char chrName) {
         T t;
-        std::stringstream ss;
-        ss << getString(chrName);
-        ss >> t;
+        valueStream.clear();
+        valueStream.str(getString(chrName));
+        valueStream >> t;
         return t;
     }
     template<typename T>
     T get(const std::string &fullName) {
         T t;
-        std::stringstream ss;
-        ss << getString(fullName);
-        ss >> t;
+        valueStream.clear();
+        valueStream.str(getString(fullName));
+        valueStream >> t;
         return t;
     }
 
@@ -218,4 +531,12 @@ public:
     void printVerbs();
 };
 
+/* -------------------------------------------------------------------------- */
+/*                                   Client                                   */
+/* -------------------------------------------------------------------------- */
+// Runs the command in a server started with arg_parser::serve, returning its
+// exit status, or -1 if no server is listening on the socket or the request is
+// too large to forward, in which case the command should be run locally
+int forwardToServer(const std::string &socketPath, int argc, char **argv);
+
 } // namespace cpp_arg_parser
@@ -2,12 +2,63 @@
 
 #include <exception>
 #include <algorithm>
+#include <bitset>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 using namespace cpp_arg_parser;
 
 const size_t maxOptionLen = 15;
 const std::string shortPrefix = "-";
 const std::string ucscorePrefix = "--";
+const std::string helpShortName = "-?";
+const std::string helpFullName = "--help";
+const std::string verbsFullName = "--verbs";
+static uint32_t nextOptionId = 0;
+static uint32_t nextOptionOrder = 0; // the order options are added to verbs and groups
+static int streamDepth = 0; // set while parseStream is parsing a record
+const size_t streamBufferSize = 1 << 16;
+const uint64_t fnvOffset = 14695981039346656037ULL;
+const uint64_t fnvPrime = 1099511628211ULL;
+const uint32_t cacheVersion = 1;
+const size_t cacheCapacity = 4096;
+const size_t cacheProbes = 8;
+const size_t cacheMaxDepth = 11;
+
+// FNV-1a, including the terminating NUL so that consecutive strings cannot run together
+static uint64_t hashString(uint64_t hash, const char *str) {
+    do {
+        hash = (hash ^ (unsigned char)*str) * fnvPrime;
+    } while (*str++);
+    return hash;
+}
+static uint64_t hashString(uint64_t hash, const std::string &str) {
+    return hashString(hash, str.c_str());
+}
+
+struct validation_cache_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t schemaHash;
+    uint64_t capacity;
+};
+// The key doubles as a sequence number: writers clear it while the path is
+// rewritten, and readers check that it is unchanged after copying the entry.
+struct cpp_arg_parser::validation_cache_entry {
+    std::atomic<uint64_t> key;
+    uint16_t depth;
+    uint16_t path[cacheMaxDepth];
+};
 
 /* -------------------------------------------------------------------------- */
 /*                                TestCriteria                                */
@@ -19,13 +70,14 @@ void test_criteria_base::error(const std::string& msg) {
         printf("%s: %s\n", getFullName(parent->fullName).c_str(), msg.c_str());
         parent->printCriteria();
     }
-    exit(1);
+    finish(1);
 }
 
 custom_test_criteria::custom_test_criteria(const std::string &errorMsg, const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
     if (desc.length() > 100) {
         error("The maximum description length is 100 chars");
     }
+    this->errorMsg = errorMsg;
     this->desc = desc;
     this->evalFnPtr = evalFnPtr;
 }
@@ -33,11 +85,18 @@ std::string custom_test_criteria::toString() {
     return "Custom test: " + desc;
 }
 void custom_test_criteria::check(const std::string &value) {
-    if (!evalFnPtr(value)) {
+    if (evalFnPtr == nullptr) {
+        error("No function was bound to the custom test: " + desc);
+    } else if (!evalFnPtr(value)) {
         error(errorMsg);
     }
 }
-custom_test_criteria &createCustom(const std::string &errorMsg, const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
+bool custom_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_custom;
+    data.strings = { errorMsg, desc };
+    return true;
+}
+custom_test_criteria &cpp_arg_parser::createCustom(const std::string &errorMsg, const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
     return *new custom_test_criteria(errorMsg, desc, evalFnPtr);
 }
 
@@ -81,6 +140,11 @@ void type_test_criteria::check(const std::string &value) {
         break;
     }
 }
+bool type_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_type;
+    data.param = (int32_t)type;
+    return true;
+}
 type_test_criteria &cpp_arg_parser::createTypeTest(TestTypes type) {
     return *new type_test_criteria( type);
 }
@@ -103,6 +167,11 @@ void number_list_test_criteria::check(const std::string &value) {
         error("Failed to parse the number");
     }
 }
+bool number_list_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_number_list;
+    data.ints.assign(numbers.begin(), numbers.end());
+    return true;
+}
 number_list_test_criteria &number_list_test_criteria::add(int number) {
     if (std::count(numbers.begin(), numbers.end(), number))
         error("The same number cannot be added twice.");
@@ -132,6 +201,11 @@ void range_test_criteria::check(const std::string &value) {
         error("Failed to parse the number");
     }
 }
+bool range_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_range;
+    data.ints = { start, end };
+    return true;
+}
 range_test_criteria &cpp_arg_parser::createRange(int start, int end) {
     return *new range_test_criteria(start, end);
 }
@@ -166,6 +240,16 @@ void number_range_test_criteria::check(const std::string &value) {
         error("Failed to parse the number");
     }
 }
+bool number_range_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_number_range;
+    data.param = (int32_t)numbers.size();
+    data.ints.assign(numbers.begin(), numbers.end());
+    for (std::pair<int, int> *r : ranges) {
+        data.ints.push_back(r->first);
+        data.ints.push_back(r->second);
+    }
+    return true;
+}
 number_range_test_criteria &number_range_test_criteria::add(int number) {
     for (int n : numbers)
         if (n == number)
@@ -194,13 +278,24 @@ std::string one_of_string_test_criteria::toString() {
         ss << p << ", ";
     return ss.str().substr(0, ss.str().length()-2);
 }
+// compared in place, as the possibilities are already lower case when the
+// case does not need to match
 void one_of_string_test_criteria::check(const std::string &value) {
-    std::string v = value;
-    if (!matchCase)
-        for (size_t i = 0; i < v.size(); i++)
-            v[i] = tolower(v[i]);
-    if (possibilities.size() && !std::count(possibilities.begin(), possibilities.end(), v))
-        error("The chosen value was not found in the configured options: " + v);
+    if (possibilities.empty())
+        return;
+    for (const std::string &possibility : possibilities) {
+        if (possibility.size() == value.size() && (matchCase ? possibility == value :
+            std::equal(possibility.begin(), possibility.end(), value.begin(),
+                [](char p, char v) { return p == tolower((unsigned char)v); })))
+            return;
+    }
+    error("The chosen value was not found in the configured options: " + value);
+}
+bool one_of_string_test_criteria::serialize(criteria_data &data) {
+    data.type = CriteriaTypes::Criteria_one_of_string;
+    data.param = matchCase;
+    data.strings = possibilities;
+    return true;
 }
 one_of_string_test_criteria &one_of_string_test_criteria::add(const std::string &possibility) {
     std::string v = possibility;
@@ -216,6 +311,140 @@ one_of_string_test_criteria &cpp_arg_parser::createOneOfString(bool matchCase) {
     return *new one_of_string_test_criteria(matchCase);
 }
 
+/* -------------------------------------------------------------------------- */
+/*                                 Constraints                                */
+/* -------------------------------------------------------------------------- */
+void constraint_base::error(const std::string &msg) {
+    printf("%s\n", msg.c_str());
+    printf("Constraint:\n\t%s\n", toString().c_str());
+    finish(1);
+}
+void constraint_base::resolve(std::vector<mask_word> &words, size_t first, size_t last) {
+    if (parent == nullptr)
+        cpp_arg_parser::error("The constraint has not been added to a verb: %s\n", toString());
+    words.clear();
+    for (size_t i = first; i < last; i++) {
+        option *opt = parent->findOption(getFullName(names[i]));
+        if (opt == nullptr)
+            cpp_arg_parser::error("The constrained option was not recognised: %s\n", getFullName(names[i]));
+        size_t index = opt->id / 64;
+        uint64_t bit = 1ULL << (opt->id % 64);
+        auto word = std::find_if(words.begin(), words.end(), [index](const mask_word &w) { return w.index == index; });
+        if (word == words.end())
+            words.push_back({ index, bit });
+        else
+            word->bits |= bit;
+    }
+}
+size_t constraint_base::countPresent(const std::vector<uint64_t> &presence, const std::vector<mask_word> &words) {
+    size_t count = 0;
+    for (const mask_word &w : words)
+        if (w.index < presence.size())
+            count += std::bitset<64>(presence[w.index] & w.bits).count();
+    return count;
+}
+std::string constraint_base::namesToString(size_t first) {
+    std::string result;
+    for (size_t i = first; i < names.size(); i++)
+        result += (i > first ? ", " : "") + getFullName(names[i]);
+    return result;
+}
+void constraint_base::addName(const std::string &fullName) {
+    if (std::count(names.begin(), names.end(), fullName))
+        cpp_arg_parser::error("The same option cannot be constrained twice: %s\n", getFullName(fullName));
+    names.push_back(fullName);
+    resolved = false;
+    inheritedResolved = false;
+}
+// A constraint also applies to the sub verbs when every option it names is
+// inherited, as those are the only verbs where the options can be given.
+bool constraint_base::isInherited() {
+    if (!inheritedResolved) {
+        if (parent == nullptr)
+            cpp_arg_parser::error("The constraint has not been added to a verb: %s\n", toString());
+        inherited = true;
+        for (const std::string &name : names) {
+            option *opt = parent->findOption(getFullName(name));
+            inherited &= opt != nullptr && opt->inherited;
+        }
+        inheritedResolved = true;
+    }
+    return inherited;
+}
+
+std::string mutually_exclusive_constraint::toString() {
+    return "Mutually exclusive: " + namesToString();
+}
+void mutually_exclusive_constraint::check(const std::vector<uint64_t> &presence) {
+    if (!resolved) {
+        resolve(mask, 0, names.size());
+        resolved = true;
+    }
+    if (countPresent(presence, mask) > 1)
+        error("Only one of these options can be used");
+}
+void mutually_exclusive_constraint::serialize(constraint_data &data) {
+    data.type = ConstraintTypes::Constraint_mutually_exclusive;
+    data.names = names;
+}
+mutually_exclusive_constraint &mutually_exclusive_constraint::add(const std::string &fullName) {
+    addName(fullName);
+    return *this;
+}
+mutually_exclusive_constraint &cpp_arg_parser::createMutuallyExclusive() {
+    return *new mutually_exclusive_constraint;
+}
+
+std::string at_least_one_constraint::toString() {
+    return "At least one of: " + namesToString();
+}
+void at_least_one_constraint::check(const std::vector<uint64_t> &presence) {
+    if (!resolved) {
+        resolve(mask, 0, names.size());
+        resolved = true;
+    }
+    if (countPresent(presence, mask) == 0)
+        error("At least one of these options is required");
+}
+void at_least_one_constraint::serialize(constraint_data &data) {
+    data.type = ConstraintTypes::Constraint_at_least_one;
+    data.names = names;
+}
+at_least_one_constraint &at_least_one_constraint::add(const std::string &fullName) {
+    addName(fullName);
+    return *this;
+}
+at_least_one_constraint &cpp_arg_parser::createAtLeastOne() {
+    return *new at_least_one_constraint;
+}
+
+requires_constraint::requires_constraint(const std::string &fullName) {
+    addName(fullName);
+}
+std::string requires_constraint::toString() {
+    return getFullName(names[0]) + " requires: " + namesToString(1);
+}
+void requires_constraint::check(const std::vector<uint64_t> &presence) {
+    if (!resolved) {
+        resolve(trigger, 0, 1);
+        resolve(mask, 1, names.size());
+        resolved = true;
+    }
+    if (countPresent(presence, trigger) && countPresent(presence, mask) != names.size() - 1)
+        error("A required option was missing for: " + getFullName(names[0]));
+}
+void requires_constraint::serialize(constraint_data &data) {
+    data.type = ConstraintTypes::Constraint_requires;
+    data.names = names;
+}
+requires_constraint &requires_constraint::add(const std::string &fullName) {
+    addName(fullName);
+    return *this;
+}
+requires_constraint &cpp_arg_parser::createRequires(const std::string &fullName) {
+    return *new requires_constraint(fullName);
+}
+
 /* -------------------------------------------------------------------------- */
 /*                                    Verbs                                   */
 /* -------------------------------------------------------------------------- */
@@ -243,16 +472,53 @@ verb &verb::addAction(void (*action)(verb *)) {
     }
     return *this;
 }
-verb &verb::addOption(option &opt) {
-    std::string ucscoreName = getFullName(opt.fullName);
-    std::string shortName = getFullName(opt.chrName);
-    if (optionsMap.count(ucscoreName))
-        error("An option with the same name has already been added: %s", ucscoreName);
-    optionsMap[ucscoreName] = &opt;
+static bool containsOption(const std::map<std::string, option*, std::less<>> &optionsMap, option &opt) {
+    return optionsMap.count(getFullName(opt.fullName)) || (opt.chrName && optionsMap.count(getFullName(opt.chrName)));
+}
+// adds the short and full names of an option to a lookup map
+static void addOptionNames(std::map<std::string, option*, std::less<>> &optionsMap, option &opt) {
+    if (containsOption(optionsMap, opt))
+        error("An option with the same name has already been added: %s", getFullName(opt.fullName));
+    optionsMap[getFullName(opt.fullName)] = &opt;
     if (opt.chrName)
-        optionsMap[shortName] = &opt;
+        optionsMap[getFullName(opt.chrName)] = &opt;
+}
+
+verb &verb::addOption(option &opt) {
+    for (option_group *group : groups)
+        if (containsOption(group->optionsMap, opt))
+            error("An option with the same name has already been added: %s", getFullName(opt.fullName));
+    addOptionNames(optionsMap, opt);
     options.push_back(&opt);
+    if (opt.required)
+        requiredOptions.push_back(&opt);
     opt.parent = this;
+    opt.order = nextOptionOrder++;
+    return *this;
+}
+verb &verb::addOptionGroup(option_group &group) {
+    if (std::count(groups.begin(), groups.end(), &group))
+        error("The same option group cannot be added twice: %s\n", group.name);
+    for (option *opt : group.options) {
+        bool clash = containsOption(optionsMap, *opt);
+        for (option_group *other : groups)
+            clash |= containsOption(other->optionsMap, *opt);
+        if (clash)
+            error("An option with the same name has already been added: %s", getFullName(opt->fullName));
+    }
+    groups.push_back(&group);
+    group.refs++;
+    return *this;
+}
+verb &verb::setPassThrough(bool passThrough) {
+    this->passThrough = passThrough;
+    return *this;
+}
+verb &verb::addConstraint(constraint_base &c) {
+    if (c.parent != nullptr)
+        error("A constraint can only be added to one verb: %s\n", c.toString());
+    constraints.push_back(&c);
+    c.parent = this;
     return *this;
 }
 verb &verb::addVerb(verb &v) {
@@ -266,6 +532,15 @@ verb &verb::addVerb(verb &v) {
     return *this;
 }
 
+void verb::load() {
+    if (blob != nullptr) {
+        schema_blob *source = blob;
+        blob = nullptr;
+        source->load(*this);
+    }
+}
+// Clears this verb and its sub verbs. arg_parser::reset no longer uses it,
+// as it only clears what the previous parse set, but it is kept for callers.
 void verb::reset() {
     isPresent = false;
     for (option *option : options) {
@@ -281,6 +556,10 @@ void verb::clear() {
         child->clear();
     for (option *opt : options)
         opt->clear();
+    for (constraint_base *c : constraints)
+        delete c;
+    for (option_group *group : groups)
+        group->release();
     verbs.clear();
     options.clear();
     verbsMap.clear();
@@ -299,8 +578,45 @@ void verb::printHelp() {
     for (option *option : options) {
         option->printHelp();
     }
+    for (option_group *group : groups) {
+        group->printHelp();
+    }
+    // inherited options that a nearer definition shadows are not shown
+    for (verb *ancestor = parent; ancestor != nullptr; ancestor = ancestor->parent) {
+        for (option *option : ancestor->options)
+            if (option->inherited && findOption(getFullName(option->fullName)) == option)
+                option->printHelp();
+        for (option_group *group : ancestor->groups)
+            for (option *option : group->options)
+                if (option->inherited && findOption(getFullName(option->fullName)) == option)
+                    option->printHelp();
+    }
+}
+
+// Looks in the verb's own options and groups, then falls through to the
+// inherited options of each ancestor, so the nearest definition wins.
+template<typename Name>
+static option *lookupOption(verb *v, const Name &name) {
+    for (verb *current = v; current != nullptr; current = current->parent) {
+        auto it = current->optionsMap.find(name);
+        if (it != current->optionsMap.end() && (current == v || it->second->inherited))
+            return it->second;
+        for (option_group *group : current->groups) {
+            auto match = group->optionsMap.find(name);
+            if (match != group->optionsMap.end() && (current == v || match->second->inherited))
+                return match->second;
+        }
+    }
+    return nullptr;
+}
+option *verb::findOption(const char *name) {
+    return lookupOption(this, name);
+}
+option *verb::findOption(const std::string &name) {
+    return lookupOption(this, name);
 }
 void verb::printVerbs(std::string prefix, bool isLast) {
+    load();
     if (desc.length()) {
         printf("%s%s %s: (%s)\n", 
             prefix.c_str(),
@@ -319,6 +635,22 @@ void verb::printVerbs(std::string prefix, bool isLast) {
             i+1 >= verbs.size());
 }
 
+uint64_t verb::fingerprint(uint64_t hash) {
+    load();
+    hash = hashString(hash, name);
+    hash = hashString(hash, desc);
+    hash = hashString(hash, std::to_string(options.size()) + "," + std::to_string(verbs.size()) + (passThrough ? ",p" : ""));
+    for (option *opt : options)
+        hash = opt->fingerprint(hash);
+    for (option_group *group : groups)
+        hash = group->fingerprint(hash);
+    for (constraint_base *c : constraints)
+        hash = hashString(hash, c->toString());
+    for (verb *v : verbs)
+        hash = v->fingerprint(hash);
+    return hash;
+}
+
 verb &cpp_arg_parser::createVerb(const std::string &name, const std::string &desc) {
     return *new verb(name, desc);
 }
@@ -350,6 +682,7 @@ option::option(const std::string &fullName, const char chrName, const std::strin
     this->expectsValue = expectsValue;
     this->required = required;
     this->isPresent = false;
+    this->id = nextOptionId++;
 }
 
 option &option::addAction(void (*action)(option *)) {
@@ -358,6 +691,32 @@ option &option::addAction(void (*action)(option *)) {
     }
     return *this;
 }
+option &option::setInherited(bool inherited) {
+    this->inherited = inherited;
+    return *this;
+}
+option &option::setDefault(const std::string &value) {
+    if (!expectsValue)
+        error("An option that does not accept a parameter cannot have a default: %s\n", fullName);
+    hasDefault = true;
+    lazyDefault = false;
+    defaultFn = nullptr;
+    defaultValue = value;
+    defaultDesc = value;
+    return *this;
+}
+// The function is not called until the value is first read, so help output
+// shows the description instead.
+option &option::setDefault(std::string (*defaultFn)(), const std::string &defaultDesc) {
+    if (!expectsValue)
+        error("An option that does not accept a parameter cannot have a default: %s\n", fullName);
+    hasDefault = true;
+    lazyDefault = true;
+    this->defaultFn = defaultFn;
+    this->defaultDesc = defaultDesc;
+    defaultValue.clear();
+    return *this;
+}
 option &option::addTestCriteria(test_criteria_base &test) {
     if (std::count(testCriteria.begin(), testCriteria.end(), &test))
         error("Two of the same criteria cannot be added");
@@ -365,6 +724,16 @@ option &option::addTestCriteria(test_criteria_base &test) {
     test.parent = this;
     return *this;
 }
+const std::string &option::getDefault() {
+    if (lazyDefault) {
+        // a lazy default loaded from a schema may not have a function bound
+        if (defaultFn == nullptr)
+            error("No function was bound to the default of: --%s\n", fullName);
+        defaultValue = defaultFn();
+        lazyDefault = false;
+    }
+    return defaultValue;
+}
 void option::check() {
     for (test_criteria_base *test: testCriteria)
         test->check(value);
@@ -381,12 +750,15 @@ void option::runAction() {
 }
 void option::printHelp() {
     std::string optionLenStr = std::to_string(maxOptionLen);
+    std::string text = desc;
+    if (hasDefault)
+        text += " (default: " + defaultDesc + ")";
     if (chrName) {
         std::string format = "    %2s, --%-" + optionLenStr + "s    %s\n";
-        printf(format.c_str(), getFullName(chrName).c_str(), fullName.c_str(), desc.c_str());
+        printf(format.c_str(), getFullName(chrName).c_str(), fullName.c_str(), text.c_str());
     } else {
         std::string format = "        --%-" + optionLenStr + "s    %s\n";
-        printf(format.c_str(), fullName.c_str(), desc.c_str());
+        printf(format.c_str(), fullName.c_str(), text.c_str());
     }
 }
 void option::printCriteria() {
@@ -397,10 +769,59 @@ void option::printCriteria() {
         printf("\t%s\n", criteria->toString().c_str());
 }
 
+uint64_t option::fingerprint(uint64_t hash) {
+    hash = hashString(hash, fullName);
+    hash = hashString(hash, desc);
+    hash = hashString(hash, std::string{chrName, expectsValue ? 'v' : '-', required ? 'r' : '-', inherited ? 'i' : '-'});
+    if (hasDefault)
+        hash = hashString(hash, (lazyDefault || defaultFn != nullptr ? "lazy:" : "value:") + defaultDesc);
+    for (test_criteria_base *criteria : testCriteria)
+        hash = hashString(hash, criteria->toString());
+    return hash;
+}
+
 option &cpp_arg_parser::createOption(const std::string &fullName, const char chrName, const std::string &desc, bool expectsValue, bool required) {
     return *new option(fullName, chrName, desc, expectsValue, required);
 }
 
+/* -------------------------------------------------------------------------- */
+/*                                Option groups                               */
+/* -------------------------------------------------------------------------- */
+option_group::option_group(const std::string &name) {
+    this->name = name;
+}
+
+option_group &option_group::addOption(option &opt) {
+    addOptionNames(optionsMap, opt);
+    options.push_back(&opt);
+    if (opt.required)
+        requiredOptions.push_back(&opt);
+    opt.order = nextOptionOrder++;
+    return *this;
+}
+void option_group::release() {
+    if (--refs > 0)
+        return;
+    for (option *opt : options)
+        opt->clear();
+    delete this;
+}
+void option_group::printHelp() {
+    for (option *option : options) {
+        option->printHelp();
+    }
+}
+uint64_t option_group::fingerprint(uint64_t hash) {
+    hash = hashString(hash, name);
+    for (option *opt : options)
+        hash = opt->fingerprint(hash);
+    return hash;
+}
+
+option_group &cpp_arg_parser::createOptionGroup(const std::string &name) {
+    return *new option_group(name);
+}
+
 /* -------------------------------------------------------------------------- */
 /*                                    Error                                   */
 /* -------------------------------------------------------------------------- */
@@ -409,7 +830,12 @@ void cpp_arg_parser::error(const std::string msg) {
 }
 void cpp_arg_parser::error(const std::string format, const std::string msg) {
     printf(format.c_str(), msg.c_str());
-    exit(1);
+    finish(1);
+}
+void cpp_arg_parser::finish(int status) {
+    if (streamDepth > 0)
+        throw parse_exit{ status };
+    exit(status);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -422,6 +848,105 @@ std::string cpp_arg_parser::getFullName(const std::string &fullName) {
     return ucscorePrefix + fullName;
 }
 
+/* -------------------------------------------------------------------------- */
+/*                                   Events                                   */
+/* -------------------------------------------------------------------------- */
+event_reader::event_reader(verb *root, const int argc, char **argv, const std::string &delimiter) {
+    this->argc = argc;
+    this->delimiter = delimiter;
+    this->argv = argv;
+    this->index = 1;
+    this->selected = root;
+    this->inVerbs = true;
+    this->done = false;
+    root->load();
+}
+
+bool event_reader::fail(parse_event &event, const char *message) {
+    event.type = EventTypes::Event_error;
+    event.message = message;
+    done = true;
+    return true;
+}
+
+bool event_reader::next(parse_event &event) {
+    if (done || index >= argc)
+        return false;
+    event = parse_event();
+    event.v = selected;
+    const char *arg = argv[index++];
+    event.value = arg;
+
+    if (delimiter != "" && arg == delimiter) {
+        return passThrough(event, index);
+    }
+    if (arg[0] != shortPrefix[0]) {
+        if (!inVerbs && selected->passThrough)
+            return passThrough(event, index - 1);
+        if (!inVerbs) {
+            event.type = EventTypes::Event_positional;
+            return true;
+        }
+        auto child = selected->verbsMap.find(arg);
+        if (child == selected->verbsMap.end() && selected->passThrough)
+            return passThrough(event, index - 1);
+        if (child == selected->verbsMap.end())
+            return fail(event, "The provided verb was not recognised");
+        selected = child->second;
+        selected->load();
+        event.type = EventTypes::Event_verb;
+        event.v = selected;
+        return true;
+    }
+    inVerbs = false;
+
+    if (arg == ucscorePrefix) { // escape sequence
+        if (index >= argc)
+            return fail(event, "An escape sequence was detected, but not followed by a value");
+        event.type = EventTypes::Event_escape;
+        event.value = argv[index++];
+        return true;
+    }
+    if (arg == helpShortName || arg == helpFullName || arg == verbsFullName) {
+        event.type = EventTypes::Event_help;
+        return true;
+    }
+
+    option *match = selected->findOption(arg);
+    if (match == nullptr && selected->passThrough)
+        return passThrough(event, index - 1);
+    if (match == nullptr)
+        return fail(event, "Unrecognised option");
+    event.type = EventTypes::Event_option;
+    event.opt = match;
+    event.value = nullptr;
+    if (event.opt->expectsValue) {
+        if (index < argc && argv[index] == ucscorePrefix)
+            index++; // skip, escape sequence
+        if (index < argc && (argv[index][0] != shortPrefix[0] || argv[index-1] == ucscorePrefix)) {
+            event.value = argv[index++];
+        } else {
+            event.value = arg;
+            return fail(event, "A required argument was not present for the option");
+        }
+    }
+    return true;
+}
+
+// the remaining arguments are reported as one event, starting at `first`
+bool event_reader::passThrough(parse_event &event, int first) {
+    event.type = EventTypes::Event_pass_through;
+    event.value = first < argc ? argv[first] : nullptr;
+    event.args = argv + first;
+    event.count = argc - first;
+    done = true;
+    return true;
+}
+
+verb *event_reader::current() {
+    return selected;
+}
+
 /* -------------------------------------------------------------------------- */
 /*                                  arg_parser                                 */
 /* -------------------------------------------------------------------------- */
@@ -431,19 +956,34 @@ arg_parser::arg_parser(bool autoPrintHelp) {
     this->autoPrintHelp = autoPrintHelp;
 }
 arg_parser::~arg_parser() {
+    closeCache();
     root->clear();
+    delete blob;
     after.clear();
     programName.clear();
     header.clear();
     footer.clear();
-    verbPatternStr.clear();
     verbPattern.clear();
 }
 
+// Only the verbs and options set by the previous parse are cleared, so the
+// cost depends on the length of argv rather than the size of the schema.
 void arg_parser::reset() {
-    root->reset();
+    for (option *option : touched) {
+        option->isPresent = false;
+        option->value.clear();
+        presence[option->id / 64] &= ~(1ULL << (option->id % 64));
+    }
+    for (verb *verb : verbPattern)
+        verb->isPresent = false;
+    root->isPresent = false;
+    if (presence.size() * 64 < nextOptionId)
+        presence.resize((nextOptionId + 63) / 64, 0);
+    touched.clear();
+    after.clear();
+    passThroughArgv = nullptr;
+    passThroughCount = 0;
     verbPattern.clear();
-    verbPatternStr.clear();
     selected = root;
 }
 
@@ -459,6 +999,66 @@ arg_parser &arg_parser::setHelpFooter(const std::string &footer) {
     this->footer = footer;
     return *this;
 }
+arg_parser &arg_parser::setPassThroughDelimiter(const std::string &delimiter) {
+    passThroughDelimiter = delimiter;
+    return *this;
+}
+arg_parser &arg_parser::setValidationCache(const std::string &cacheDir, uint64_t schemaVersion) {
+    this->cacheDir = cacheDir;
+    this->schemaVersion = schemaVersion;
+    return *this;
+}
+void arg_parser::writeSchema(const std::string &path) {
+    schema_blob::write(path, *root, programName, header, footer, passThroughDelimiter, schemaFingerprint());
+}
+arg_parser &arg_parser::loadSchema(const std::string &path) {
+    if (blob != nullptr || root->verbs.size() || root->options.size())
+        error("A schema can only be loaded into an empty parser\n");
+    blob = new schema_blob(path);
+    programName = blob->programName();
+    header = blob->header();
+    footer = blob->footer();
+    passThroughDelimiter = blob->passThroughDelimiter();
+    root->blob = blob;
+    root->blobIndex = 0;
+    return *this;
+}
+arg_parser &arg_parser::bindCustom(const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
+    if (blob == nullptr)
+        error("A schema must be loaded before binding functions\n");
+    blob->bindCustom(desc, evalFnPtr);
+    return *this;
+}
+arg_parser &arg_parser::bindCustom(const std::string &verbPath, const std::string &fullName, const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
+    if (blob == nullptr)
+        error("A schema must be loaded before binding functions\n");
+    blob->bindCustom(verbPath, fullName, desc, evalFnPtr);
+    return *this;
+}
+arg_parser &arg_parser::bindVerbAction(const std::string &verbPath, void (*action)(verb *)) {
+    if (blob == nullptr)
+        error("A schema must be loaded before binding functions\n");
+    blob->bindAction(verbPath, action);
+    return *this;
+}
+arg_parser &arg_parser::bindOptionAction(const std::string &fullName, void (*action)(option *)) {
+    return bindOptionAction("", fullName, action);
+}
+arg_parser &arg_parser::bindOptionAction(const std::string &verbPath, const std::string &fullName, void (*action)(option *)) {
+    if (blob == nullptr)
+        error("A schema must be loaded before binding functions\n");
+    blob->bindAction(verbPath, fullName, action);
+    return *this;
+}
+arg_parser &arg_parser::bindOptionDefault(const std::string &fullName, std::string (*defaultFn)()) {
+    return bindOptionDefault("", fullName, defaultFn);
+}
+arg_parser &arg_parser::bindOptionDefault(const std::string &verbPath, const std::string &fullName, std::string (*defaultFn)()) {
+    if (blob == nullptr)
+        error("A schema must be loaded before binding functions\n");
+    blob->bindDefault(verbPath, fullName, defaultFn);
+    return *this;
+}
 arg_parser &arg_parser::addOption(option &o) {
     root->addOption(o);
     return *this;
@@ -467,22 +1067,79 @@ arg_parser &arg_parser::addVerb(verb &v) {
     root->addVerb(v);
     return *this;
 }
+arg_parser &arg_parser::addOptionGroup(option_group &group) {
+    root->addOptionGroup(group);
+    return *this;
+}
+arg_parser &arg_parser::addConstraint(constraint_base &c) {
+    root->addConstraint(c);
+    return *this;
+}
+
+static void checkRequired(option *option) {
+    if (!option->isPresent || (option->expectsValue && option->value == "")) {
+        std::string optionName = getFullName(option->chrName) + " / " + getFullName(option->fullName);
+        printf("A required option was missing: %s\n", optionName.c_str());
+        option->printCriteria();
+        finish(1);
+    }
+}
 
 void arg_parser::parse(const int argc, char **argv) {
     reset();
+    root->load();
     if (argc < 2 && autoPrintHelp) {
         printHelp(root);
-        exit(0);
+        finish(0);
     } else {
         if (programName == "")
             programName = argv[0];
+
+        // argv that has already been validated against this schema
+        uint16_t cachedPath[cacheMaxDepth];
+        int cachedDepth = -1;
+        uint64_t key = 0;
+        if (cacheDir != "") {
+            if (schemaHash == 0)
+                openCache();
+            if (cacheEntries != nullptr) {
+                key = cacheKey(argc, argv);
+                cachedDepth = lookupCache(key, argc, argv, cachedPath);
+            }
+        }
+
+        // everything after the delimiter is passed through untouched
+        int end = argc;
+        if (passThroughDelimiter != "") {
+            for (int i = 1; i < argc; i++) {
+                if (argv[i] == passThroughDelimiter) {
+                    end = i;
+                    setPassThrough(argv, i + 1, argc);
+                    break;
+                }
+            }
+        }
+
         int start = 1;
-        for (; start < argc && argv[start][0] != shortPrefix[0]; start++) {
+        if (cachedDepth >= 0) {
+            for (; start <= cachedDepth; start++) {
+                selected->isPresent = true;
+                selected = selected->verbs[cachedPath[start-1]];
+                selected->load();
+                verbPattern.push_back(selected);
+            }
+        }
+        for (; start < end && argv[start][0] != shortPrefix[0]; start++) {
             selected->isPresent = true;
-            if (selected->verbsMap.count(argv[start])) {
-                selected = selected->verbsMap[argv[start]];
-                verbPatternStr.push_back(argv[start]);
+            auto child = selected->verbsMap.find(argv[start]);
+            if (child != selected->verbsMap.end()) {
+                selected = child->second;
+                selected->load();
                 verbPattern.push_back(selected);
+            } else if (selected->passThrough) {
+                end = start;
+                setPassThrough(argv, start, argc);
+                break;
             } else {
                 error("The provided verb was not recognised: %s\n", argv[start]);
             }
@@ -491,114 +1148,429 @@ void arg_parser::parse(const int argc, char **argv) {
         // print help and exit if no args supplied
         if (start >= argc && autoPrintHelp) { 
             printHelp(selected);
-            exit(0);
+            finish(0);
         }
 
-        // stores whether the arguments are options, not checking if they are configured
-        bool* argIsOption = new bool[argc] {};
-        bool* argIsHelp = new bool[argc] {};
-        for (int i = start; i < argc; i++) {
+        // stores whether the arguments are options, not checking if they are configured.
+        // the flags are kept between parses so that their storage is reused
+        argFlags.assign(argc, false);
+        char *argIsOption = argFlags.data();
+        for (int i = start; i < end; i++) {
             argIsOption[i] = argv[i][0] == shortPrefix[0];
         }
-        for (int i = start; i < argc; i++) {
-            if (argIsOption[i] && argv[i] == ucscorePrefix && i+1 < argc && argIsOption[i+1]) {
+        for (int i = start; i < end; i++) {
+            if (argIsOption[i] && argv[i] == ucscorePrefix && i+1 < end && argIsOption[i+1]) {
                 argIsOption[i+1] = false;
             }
         }
 
         // finds the position of the last option
         int lastOption = 1;
-        for (int i = start; i < argc; i++) {
+        for (int i = start; i < end; i++) {
             if (argIsOption[i] && argv[i] != ucscorePrefix) {
                 lastOption = i;
             }
         };
 
-        // check for help keywords
-        for (int i = start; i < argc; i++) {
-            argIsHelp[i] = true;
-            if (argIsOption[i] && (argv[i] == getFullName('?') || argv[i] == getFullName("help"))) {
-                printHelp(selected);
-                exit(0);
-            } else if (argv[i] == getFullName("verbs")) {
-                printVerbs();
-                exit(0);
-            } else {
-                argIsHelp[i] = false;
+        // check for help keywords. a pass through verb checks them as it parses,
+        // as the arguments that are passed through may contain their own
+        for (int i = start; i < end && !selected->passThrough; i++) {
+            if (argIsOption[i]) {
+                checkHelp(argv[i]);
             }
         }
 
         // parses the options and any arguments after
-        for (int i = start; i < argc; i++) {
-            if (argIsHelp[i]) {
-                continue;
-            } else if (argIsOption[i]) {
+        for (int i = start; i < end; i++) {
+            if (argIsOption[i]) {
+                option *match = selected->findOption(argv[i]);
                 if (argv[i] == ucscorePrefix) { // escape sequence
-                    if (i+1 > argc) { // no option after
+                    if (i+1 > end) { // no option after
                         error("An escape sequences was detected, but not followed by a value.");
                     }
-                } else if (selected->optionsMap.count(argv[i])) {
-                    option *option = selected->optionsMap[argv[i]];
+                } else if (match != nullptr) {
+                    option *option = match;
                     if (!option->isPresent) {
                         option->isPresent = true;
+                        if (option->id / 64 >= presence.size()) // created by a lazily loaded verb
+                            presence.resize(nextOptionId / 64 + 1);
+                        presence[option->id / 64] |= 1ULL << (option->id % 64);
+                        touched.push_back(option);
                         if (option->expectsValue) { // expects a value
-                            if (i+1 < argc && argIsOption[i+1] && argv[i+1] == ucscorePrefix) {
+                            if (i+1 < end && argIsOption[i+1] && argv[i+1] == ucscorePrefix) {
                                 i++; // skip, escape sequence
                             }
 
-                            if (i+1 < argc && !argIsOption[i+1]) {
+                            if (i+1 < end && !argIsOption[i+1]) {
                                 option->value = argv[++i];
                             } else { // no valid option
                                 printf("A required argument was not present for the option: %s\n", argv[i]);
                                 option->printCriteria();
-                                exit(1);
+                                finish(1);
                             }
                         }
                     } else {
                         std::string optionName = getFullName(option->chrName) + " / " + getFullName(option->fullName);
                         error("Multiple occurances of an option: %s\n", optionName);
                     }
+                } else if (selected->passThrough) {
+                    checkHelp(argv[i]);
+                    setPassThrough(argv, i, argc);
+                    break;
                 } else {
                     error("Unrecognised option: %s\n", argv[i]);
                 }
+            } else if (selected->passThrough) {
+                setPassThrough(argv, i, argc);
+                break;
             } else if (i >= lastOption) {
                 after.push_back(argv[i]);
             } else {
                 error("Parameter without option: %s\n", argv[i]);
             }
         }
-        delete [] argIsOption;
 
         // check that option conditions have been met
-        for (option *option: selected->options) {
-            std::string optionName = getFullName(option->chrName) + " / " + getFullName(option->fullName);
-            if (option->required && (!option->isPresent || (option->expectsValue && option->value == ""))) {
-                printf("A required option was missing: %s\n", optionName.c_str());
-                option->printCriteria();
-                exit(1);
+        if (cachedDepth < 0) {
+            for (verb *current = selected; current != nullptr; current = current->parent) {
+                for (option *option: current->requiredOptions) {
+                    if (current == selected || option->inherited) {
+                        checkRequired(option);
+                    }
+                }
+                for (option_group *group : current->groups) {
+                    for (option *option: group->requiredOptions) {
+                        if (current == selected || option->inherited) {
+                            checkRequired(option);
+                        }
+                    }
+                }
+            }
+            for (option *option: touched) {
+                if (option->value != "") {
+                    option->check();
+                }
+            }
+            for (verb *current = selected; current != nullptr; current = current->parent) {
+                for (constraint_base *c : current->constraints) {
+                    if (current == selected || c->isInherited()) {
+                        c->check(presence);
+                    }
+                }
             }
+            if (key != 0) {
+                storeCache(key, (int)verbPattern.size());
+            }
+        }
 
-            if (option->value != "") {
-                option->check();
+        // run any actions, only the verbs in the pattern can be present
+        if (root->isPresent && root->actionFn != nullptr)
+            root->actionFn(root);
+        for (verb *verb : verbPattern) {
+            if (verb->isPresent && verb->actionFn != nullptr) {
+                verb->actionFn(verb);
             }
         }
+        // option actions run in the order the options were added to their verbs
+        std::sort(touched.begin(), touched.end(), [](option *a, option *b) { return a->order < b->order; });
+        for (option *option: touched) {
+            option->runAction();
+        }
+    }
+}
+
+void arg_parser::checkHelp(const char *arg) {
+    if (arg == helpShortName || arg == helpFullName) {
+        printHelp(selected);
+        finish(0);
+    } else if (arg == verbsFullName) {
+        printVerbs();
+        finish(0);
+    }
+}
+void arg_parser::setPassThrough(char **argv, int first, int argc) {
+    passThroughArgv = argv + first;
+    passThroughCount = argc - first;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              Validation cache                              */
+/* -------------------------------------------------------------------------- */
+// The cache file is named after the schema fingerprint, so a changed schema
+// never reads entries written by another. The fingerprint is taken from the
+// version given to setValidationCache, or from the schema blob where it was
+// computed at build time. Only a schema built in code without a version is
+// hashed here. Any failure leaves the cache disabled rather than failing the
+// parse.
+void arg_parser::openCache() {
+    // the delimiter decides which arguments are validated, so it is part of
+    // the fingerprint, including when it was changed after loading a blob
+    if (schemaVersion != 0)
+        schemaHash = hashString(hashString(hashString(fnvOffset, "arg_parser"), std::to_string(schemaVersion)), passThroughDelimiter);
+    else if (blob != nullptr)
+        schemaHash = hashString(blob->fingerprint(), passThroughDelimiter);
+    else
+        schemaHash = schemaFingerprint();
+    if (schemaHash == 0)
+        schemaHash = 1;
+#ifndef _WIN32
+    char fileName[40];
+    snprintf(fileName, sizeof(fileName), "/arg_parser-%016llx.cache", (unsigned long long)schemaHash);
+    std::string path = cacheDir + fileName;
+    size_t size = sizeof(validation_cache_header) + cacheCapacity * sizeof(validation_cache_entry);
+
+    // the entries let argv skip validation, so the file must not be writable
+    // by anyone else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+        (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+        ((size_t)st.st_size != size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    validation_cache_header *header = (validation_cache_header*)map;
+    if (memcmp(header->magic, "APVC", 4) || header->version != cacheVersion ||
+        header->schemaHash != schemaHash || header->capacity != cacheCapacity) {
+        memset(map, 0, size);
+        memcpy(header->magic, "APVC", 4);
+        header->version = cacheVersion;
+        header->schemaHash = schemaHash;
+        header->capacity = cacheCapacity;
+    }
+    cacheEntries = (validation_cache_entry*)(header + 1);
+    cacheSize = size;
+#endif
+}
+void arg_parser::closeCache() {
+#ifndef _WIN32
+    if (cacheEntries != nullptr)
+        munmap((char*)cacheEntries - sizeof(validation_cache_header), cacheSize);
+#endif
+    cacheEntries = nullptr;
+    cacheSize = 0;
+}
+uint64_t arg_parser::schemaFingerprint() {
+    return root->fingerprint(hashString(hashString(fnvOffset, "arg_parser"), passThroughDelimiter));
+}
+uint64_t arg_parser::cacheKey(const int argc, char **argv) {
+    uint64_t key = schemaHash;
+    for (int i = 1; i < argc; i++)
+        key = hashString(key, argv[i]);
+    return key == 0 ? 1 : key;
+}
+// Copies the verb path of a matching entry into `path`, returning its depth,
+// or -1 if there is none. The entry may be rewritten by another process at
+// any time, so only the copy is validated and used.
+int arg_parser::lookupCache(uint64_t key, const int argc, char **argv, uint16_t *path) {
+    for (size_t probe = 0; probe < cacheProbes; probe++) {
+        validation_cache_entry *entry = &cacheEntries[(key + probe) % cacheCapacity];
+        uint64_t entryKey = entry->key.load(std::memory_order_acquire);
+        if (entryKey == 0)
+            return -1;
+        if (entryKey != key)
+            continue;
+
+        uint16_t depth = entry->depth;
+        memcpy(path, entry->path, sizeof(entry->path));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry->key.load(std::memory_order_relaxed) != key)
+            return -1;
+
+        // ignore entries whose verb path does not name the verbs in argv, as
+        // concurrent writers to the same slot can leave a mismatched path
+        if (depth > cacheMaxDepth || depth >= argc)
+            return -1;
+        verb *v = root;
+        for (size_t i = 0; i < depth; i++) {
+            v->load();
+            if (path[i] >= v->verbs.size() || v->verbs[path[i]]->name != argv[i + 1])
+                return -1;
+            v = v->verbs[path[i]];
+        }
+        return depth;
+    }
+    return -1;
+}
+void arg_parser::storeCache(uint64_t key, int verbCount) {
+    if (verbCount > (int)cacheMaxDepth)
+        return;
+    validation_cache_entry *entry = &cacheEntries[key % cacheCapacity];
+    for (size_t probe = 0; probe < cacheProbes; probe++) {
+        validation_cache_entry *slot = &cacheEntries[(key + probe) % cacheCapacity];
+        if (slot->key == 0 || slot->key == key) {
+            entry = slot;
+            break;
+        }
+    }
+
+    // the key is cleared while the path is written, so readers that copied a
+    // half written path see the key change and discard it
+    entry->key.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    entry->depth = (uint16_t)verbCount;
+    for (int i = 0; i < verbCount; i++) {
+        std::vector<verb*> &siblings = verbPattern[i]->parent->verbs;
+        entry->path[i] = (uint16_t)(std::find(siblings.begin(), siblings.end(), verbPattern[i]) - siblings.begin());
+    }
+    entry->key.store(key, std::memory_order_release);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                 parseStream                                */
+/* -------------------------------------------------------------------------- */
+// Splits the record starting at `p` in place, storing pointers to each argument
+// in `args`. Returns a pointer past the end of the record, or nullptr when the
+// record is not yet complete.
+static char *nextRecord(char *p, char *end, char delim, std::vector<char*> &args) {
+    if (delim == '\0') {
+        // arguments are NUL terminated, an empty argument ends the record
+        while (p < end) {
+            char *terminator = (char*)memchr(p, '\0', end - p);
+            if (terminator == nullptr)
+                return nullptr;
+            if (terminator == p)
+                return p + 1;
+            args.push_back(p);
+            p = terminator + 1;
+        }
+        return nullptr;
+    }
+
+    // one record per line, arguments separated by whitespace
+    char *terminator = (char*)memchr(p, delim, end - p);
+    if (terminator == nullptr)
+        return nullptr;
+    bool inArg = false;
+    for (; p < terminator; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '\r') {
+            *p = '\0';
+            inArg = false;
+        } else if (!inArg) {
+            args.push_back(p);
+            inArg = true;
+        }
+    }
+    *terminator = '\0';
+    return terminator + 1;
+}
+
+static long readChunk(int fd, char *buffer, size_t size) {
+#ifdef _WIN32
+    return _read(fd, buffer, (unsigned)size);
+#else
+    return read(fd, buffer, size);
+#endif
+}
+
+// A record that fails validation, or asks for help, prints its message and
+// ends without calling recordFn. The remaining records are still parsed, and
+// the number of records that failed is returned. The results of each record
+// are only available within recordFn, as the parser is reset on return.
+int arg_parser::parseStream(int fd, char delim, void (*recordFn)(arg_parser *)) {
+    std::vector<char> buffer(streamBufferSize);
+    std::vector<char*> args;
+    size_t used = 0;
+    int failed = 0;
+    bool eof = false;
+
+    while (!eof) {
+        if (used == buffer.size())
+            buffer.resize(buffer.size() * 2);
+
+        long n = readChunk(fd, buffer.data() + used, buffer.size() - used);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("Failed to read the command stream: %s\n", strerror(errno));
+        }
+        used += n;
+
+        // terminate a trailing record that was not followed by a delimiter
+        if (n == 0) {
+            eof = true;
+            if (used == 0)
+                break;
+            buffer.resize(used + 2);
+            buffer[used++] = delim;
+            buffer[used++] = delim;
+        }
 
-        // run any actions (recursive)
-        root->runAction();
-        for (option *option: selected->options) {
-            if (option->isPresent) {
-                option->runAction();
+        // parse and dispatch every complete record in the buffer
+        char *begin = buffer.data(), *end = buffer.data() + used;
+        for (;;) {
+            args.assign(1, const_cast<char*>(programName.c_str()));
+            char *next = nextRecord(begin, end, delim, args);
+            if (next == nullptr)
+                break;
+            begin = next;
+            if (args.size() < 2)
+                continue;
+            args.push_back(nullptr);
+
+            // an error or help request only ends its own record
+            streamDepth++;
+            try {
+                parse((int)args.size() - 1, args.data());
+                if (recordFn != nullptr)
+                    recordFn(this);
+            } catch (const parse_exit &e) {
+                failed += e.status != 0;
             }
+            streamDepth--;
         }
+
+        // keep the partial record for the next read
+        used = end - begin;
+        memmove(buffer.data(), begin, used);
     }
+
+    // the arguments and pass through range point into the buffer being freed
+    reset();
+    return failed;
+}
+
+// builds the prefixed name in a reused buffer to avoid allocating on each lookup
+const std::string &arg_parser::optionName(const char chrName) {
+    nameBuffer.assign(shortPrefix);
+    nameBuffer += chrName;
+    return nameBuffer;
+}
+const std::string &arg_parser::optionName(const std::string &fullName) {
+    nameBuffer.assign(ucscorePrefix);
+    nameBuffer += fullName;
+    return nameBuffer;
 }
+
+event_reader arg_parser::events(const int argc, char **argv) {
+    return event_reader(root, argc, argv, passThroughDelimiter);
+}
+line_analyser arg_parser::analyser() {
+    return line_analyser(root, passThroughDelimiter);
+}
+
+char **arg_parser::getPassThrough() {
+    static char *empty[] = { nullptr };
+    return passThroughArgv != nullptr ? passThroughArgv : empty;
+}
+int arg_parser::getPassThroughCount() {
+    return passThroughCount;
+}
+
 bool arg_parser::isPresent(const char chrName) {
-    std::string name = getFullName(chrName);
-    return selected->optionsMap.count(name) && selected->optionsMap[name]->isPresent;
+    option *option = selected->findOption(optionName(chrName));
+    return option != nullptr && option->isPresent;
 }
 bool arg_parser::isPresent(const std::string &fullName) {
-    std::string name = getFullName(fullName);
-    return selected->optionsMap.count(name) && selected->optionsMap[name]->isPresent;
+    option *option = selected->findOption(optionName(fullName));
+    return option != nullptr && option->isPresent;
 }
 bool arg_parser::verbPresent(const std::string &name) {
     for (const auto verbPtr : verbPattern)
@@ -607,30 +1579,35 @@ bool arg_parser::verbPresent(const std::string &name) {
     return false;
 }
 
-std::string arg_parser::getString(const char chrName) {
-    std::string name = getFullName(chrName);
-    if (!selected->optionsMap.count(name))
+const std::string &arg_parser::getString(const char chrName) {
+    const std::string &name = optionName(chrName);
+    option *option = selected->findOption(name);
+    if (option == nullptr)
         error("The specified option was not recognised: %s\n", name);
-    option *option = selected->optionsMap[name];
     if (!option->expectsValue)
         error("The selected option does not accept a parameter: %s\n", name);
+    if (!option->isPresent && option->hasDefault)
+        return option->getDefault();
     return option->value;
 }
-std::string arg_parser::getString(const std::string &fullName) {
-    std::string name = getFullName(fullName);
-    if (!selected->optionsMap.count(name))
+const std::string &arg_parser::getString(const std::string &fullName) {
+    const std::string &name = optionName(fullName);
+    option *option = selected->findOption(name);
+    if (option == nullptr)
         error("The specified option was not recognised: %s\n", name);
-    option *option = selected->optionsMap[name];
     if (!option->expectsValue)
         error("The selected option does not accept a parameter: %s\n", name);
+    if (!option->isPresent && option->hasDefault)
+        return option->getDefault();
     return option->value;
 }
 
 void arg_parser::printHelp(verb *v) {
+    v->load();
     if (v != root) { // sub verb
         std::stringstream ss;
-        for (std::string verb : verbPatternStr)
-            ss << verb << ' ';
+        for (verb *verb : verbPattern)
+            ss << verb->name << ' ';
         printf("Usage: %s %s[options] [args]\n%s\n", programName.c_str(), ss.str().c_str(), header.c_str());
         printf("\nSelected verb pattern: %s %s\n", programName.c_str(), ss.str().c_str());
         if (v->desc.length()) {
@@ -646,6 +1623,7 @@ void arg_parser::printHelp(verb *v) {
     printf("%s", footer.c_str());
 }
 void arg_parser::printVerbs() {
+    root->load();
     printf("%s: (program name)\n", programName.c_str());
     for (size_t i = 0; i < root->verbs.size(); i++)
         root->verbs[i]->printVerbs(
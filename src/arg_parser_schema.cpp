@@ -0,0 +1,530 @@
+#include "arg_parser/arg_parser.hpp"
+
+#include <cstring>
+#include <cstdio>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace cpp_arg_parser;
+
+/* -------------------------------------------------------------------------- */
+/*                                 Blob layout                                */
+/* -------------------------------------------------------------------------- */
+// A blob is a header followed by the verb, option group, option, criteria,
+// constraint, int and string tables, then the NUL terminated string data.
+// Every reference is an index or an offset from the start of its table, so
+// the blob can be mapped anywhere. Verbs are stored breadth first with the
+// root at index 0, so the children of a verb are contiguous. The option
+// groups used by a verb are listed in the int table. Values are stored in the
+// native byte order.
+const char blobMagic[4] = { 'A', 'P', 'S', 'B' };
+const uint32_t blobVersion = 6;
+const uint32_t verbPassThrough = 1;
+const uint32_t optionDefault = 1, optionLazyDefault = 2;
+
+struct blob_header {
+    char magic[4];
+    uint32_t version, size;
+    uint32_t verbCount, groupCount, optionCount, criteriaCount, constraintCount, intCount, stringCount, charsSize;
+    uint32_t programName, header, footer, passThroughDelimiter;
+    uint32_t fingerprintLow, fingerprintHigh;
+};
+struct blob_verb {
+    uint32_t name, desc, flags;
+    uint32_t firstChild, childCount, firstOption, optionCount, firstConstraint, constraintCount;
+    uint32_t firstGroupRef, groupRefCount;
+};
+struct blob_group {
+    uint32_t name;
+    uint32_t firstOption, optionCount;
+};
+struct blob_option {
+    uint32_t fullName, desc;
+    uint32_t firstCriteria, criteriaCount;
+    uint32_t defaultDesc, defaultFlags;
+    uint8_t chrName, expectsValue, required, inherited;
+};
+struct blob_criteria {
+    uint32_t type;
+    int32_t param;
+    uint32_t firstInt, intCount, firstString, stringCount;
+};
+struct blob_constraint {
+    uint32_t type;
+    uint32_t firstString, stringCount;
+};
+
+static const blob_header *headerOf(const char *data) {
+    return (const blob_header*)data;
+}
+static const blob_verb *verbsOf(const char *data) {
+    return (const blob_verb*)(data + sizeof(blob_header));
+}
+static const blob_group *groupsOf(const char *data) {
+    return (const blob_group*)(verbsOf(data) + headerOf(data)->verbCount);
+}
+static const blob_option *optionsOf(const char *data) {
+    return (const blob_option*)(groupsOf(data) + headerOf(data)->groupCount);
+}
+static const blob_criteria *criteriaOf(const char *data) {
+    return (const blob_criteria*)(optionsOf(data) + headerOf(data)->optionCount);
+}
+static const blob_constraint *constraintsOf(const char *data) {
+    return (const blob_constraint*)(criteriaOf(data) + headerOf(data)->criteriaCount);
+}
+static const int32_t *intsOf(const char *data) {
+    return (const int32_t*)(constraintsOf(data) + headerOf(data)->constraintCount);
+}
+static const uint32_t *stringsOf(const char *data) {
+    return (const uint32_t*)(intsOf(data) + headerOf(data)->intCount);
+}
+static const char *charsOf(const char *data) {
+    return (const char*)(stringsOf(data) + headerOf(data)->stringCount);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   Writing                                  */
+/* -------------------------------------------------------------------------- */
+struct schema_blob_writer {
+    std::vector<blob_verb> verbs;
+    std::vector<blob_group> groups;
+    std::vector<blob_option> options;
+    std::vector<blob_criteria> criteria;
+    std::vector<blob_constraint> constraints;
+    std::vector<int32_t> ints;
+    std::vector<uint32_t> strings;
+    std::string chars;
+    std::map<std::string, uint32_t> offsets;
+    std::map<option_group*, uint32_t> groupIndexes;
+
+    uint32_t addString(const std::string &str) {
+        auto it = offsets.find(str);
+        if (it != offsets.end())
+            return it->second;
+        uint32_t offset = (uint32_t)chars.size();
+        chars += str;
+        chars += '\0';
+        offsets[str] = offset;
+        return offset;
+    }
+
+    void addOption(option &opt) {
+        blob_option o = {};
+        o.fullName = addString(opt.fullName);
+        o.desc = addString(opt.desc);
+        o.firstCriteria = (uint32_t)criteria.size();
+        o.criteriaCount = (uint32_t)opt.testCriteria.size();
+        o.chrName = (uint8_t)opt.chrName;
+        o.expectsValue = opt.expectsValue;
+        o.required = opt.required;
+        o.inherited = opt.inherited;
+        // lazy defaults keep only their description, the function is bound on load
+        if (opt.hasDefault) {
+            o.defaultDesc = addString(opt.defaultDesc);
+            o.defaultFlags = optionDefault;
+            if (opt.lazyDefault || opt.defaultFn != nullptr)
+                o.defaultFlags |= optionLazyDefault;
+        }
+        options.push_back(o);
+
+        for (test_criteria_base *test : opt.testCriteria) {
+            criteria_data data;
+            if (!test->serialize(data))
+                error("The criteria cannot be written to a schema: %s\n", test->toString());
+            blob_criteria c = {};
+            c.type = (uint32_t)data.type;
+            c.param = data.param;
+            c.firstInt = (uint32_t)ints.size();
+            c.intCount = (uint32_t)data.ints.size();
+            c.firstString = (uint32_t)strings.size();
+            c.stringCount = (uint32_t)data.strings.size();
+            ints.insert(ints.end(), data.ints.begin(), data.ints.end());
+            for (const std::string &str : data.strings)
+                strings.push_back(addString(str));
+            criteria.push_back(c);
+        }
+    }
+};
+
+void schema_blob::write(const std::string &path, verb &root, const std::string &programName,
+    const std::string &header, const std::string &footer, const std::string &passThroughDelimiter, uint64_t fingerprint) {
+    schema_blob_writer w;
+    blob_header h = {};
+    memcpy(h.magic, blobMagic, sizeof(blobMagic));
+    h.version = blobVersion;
+    h.programName = w.addString(programName);
+    h.header = w.addString(header);
+    h.footer = w.addString(footer);
+    h.passThroughDelimiter = w.addString(passThroughDelimiter);
+    h.fingerprintLow = (uint32_t)fingerprint;
+    h.fingerprintHigh = (uint32_t)(fingerprint >> 32);
+
+    std::vector<verb*> queue { &root };
+    for (size_t i = 0; i < queue.size(); i++) {
+        verb *v = queue[i];
+        v->load();
+
+        blob_verb record = {};
+        record.name = w.addString(v->name);
+        record.desc = w.addString(v->desc);
+        record.flags = v->passThrough ? verbPassThrough : 0;
+        record.firstChild = (uint32_t)queue.size();
+        record.childCount = (uint32_t)v->verbs.size();
+        record.firstOption = (uint32_t)w.options.size();
+        record.optionCount = (uint32_t)v->options.size();
+        record.firstConstraint = (uint32_t)w.constraints.size();
+        record.constraintCount = (uint32_t)v->constraints.size();
+        queue.insert(queue.end(), v->verbs.begin(), v->verbs.end());
+
+        for (constraint_base *c : v->constraints) {
+            constraint_data data;
+            c->serialize(data);
+            blob_constraint bc = {};
+            bc.type = (uint32_t)data.type;
+            bc.firstString = (uint32_t)w.strings.size();
+            bc.stringCount = (uint32_t)data.names.size();
+            for (const std::string &name : data.names)
+                w.strings.push_back(w.addString(name));
+            w.constraints.push_back(bc);
+        }
+
+        for (option *opt : v->options)
+            w.addOption(*opt);
+
+        // groups are written once, the first time a verb uses them
+        for (option_group *group : v->groups) {
+            if (w.groupIndexes.count(group))
+                continue;
+            blob_group g = {};
+            g.name = w.addString(group->name);
+            g.firstOption = (uint32_t)w.options.size();
+            g.optionCount = (uint32_t)group->options.size();
+            for (option *opt : group->options)
+                w.addOption(*opt);
+            w.groupIndexes[group] = (uint32_t)w.groups.size();
+            w.groups.push_back(g);
+        }
+        record.firstGroupRef = (uint32_t)w.ints.size();
+        record.groupRefCount = (uint32_t)v->groups.size();
+        for (option_group *group : v->groups)
+            w.ints.push_back((int32_t)w.groupIndexes[group]);
+
+        w.verbs.push_back(record);
+    }
+
+    h.verbCount = (uint32_t)w.verbs.size();
+    h.groupCount = (uint32_t)w.groups.size();
+    h.optionCount = (uint32_t)w.options.size();
+    h.criteriaCount = (uint32_t)w.criteria.size();
+    h.constraintCount = (uint32_t)w.constraints.size();
+    h.intCount = (uint32_t)w.ints.size();
+    h.stringCount = (uint32_t)w.strings.size();
+    h.charsSize = (uint32_t)w.chars.size();
+    h.size = (uint32_t)(sizeof(h)
+        + w.verbs.size() * sizeof(blob_verb)
+        + w.groups.size() * sizeof(blob_group)
+        + w.options.size() * sizeof(blob_option)
+        + w.criteria.size() * sizeof(blob_criteria)
+        + w.constraints.size() * sizeof(blob_constraint)
+        + w.ints.size() * sizeof(int32_t)
+        + w.strings.size() * sizeof(uint32_t)
+        + w.chars.size());
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == nullptr)
+        error("Failed to open the schema for writing: %s\n", path);
+    fwrite(&h, sizeof(h), 1, file);
+    fwrite(w.verbs.data(), sizeof(blob_verb), w.verbs.size(), file);
+    fwrite(w.groups.data(), sizeof(blob_group), w.groups.size(), file);
+    fwrite(w.options.data(), sizeof(blob_option), w.options.size(), file);
+    fwrite(w.criteria.data(), sizeof(blob_criteria), w.criteria.size(), file);
+    fwrite(w.constraints.data(), sizeof(blob_constraint), w.constraints.size(), file);
+    fwrite(w.ints.data(), sizeof(int32_t), w.ints.size(), file);
+    fwrite(w.strings.data(), sizeof(uint32_t), w.strings.size(), file);
+    fwrite(w.chars.data(), 1, w.chars.size(), file);
+    if (ferror(file) | fclose(file))
+        error("Failed to write the schema: %s\n", path);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                   Loading                                  */
+/* -------------------------------------------------------------------------- */
+schema_blob::schema_blob(const std::string &path) {
+    data = nullptr;
+    size = 0;
+#ifdef _WIN32
+    FILE *file = fopen(path.c_str(), "rb");
+    if (file != nullptr) {
+        fseek(file, 0, SEEK_END);
+        long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        if (length > 0) {
+            data = new char[length];
+            size = fread(data, 1, length, file);
+        }
+        fclose(file);
+    }
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            data = (char*)map;
+            size = st.st_size;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (data == nullptr)
+        error("Failed to open the schema: %s\n", path);
+
+    // check the table sizes add up before anything is read through them
+    const blob_header *h = headerOf(data);
+    if (size < sizeof(blob_header) || memcmp(h->magic, blobMagic, sizeof(blobMagic)) ||
+        h->version != blobVersion || h->size != size)
+        error("The schema is invalid or was written by another version: %s\n", path);
+    uint64_t expected = sizeof(blob_header)
+        + (uint64_t)h->verbCount * sizeof(blob_verb)
+        + (uint64_t)h->groupCount * sizeof(blob_group)
+        + (uint64_t)h->optionCount * sizeof(blob_option)
+        + (uint64_t)h->criteriaCount * sizeof(blob_criteria)
+        + (uint64_t)h->constraintCount * sizeof(blob_constraint)
+        + (uint64_t)h->intCount * sizeof(int32_t)
+        + (uint64_t)h->stringCount * sizeof(uint32_t)
+        + h->charsSize;
+    if (expected != size || h->verbCount == 0 || h->charsSize == 0 || charsOf(data)[h->charsSize - 1] != '\0')
+        error("The schema is corrupt: %s\n", path);
+    groups.assign(h->groupCount, nullptr);
+}
+schema_blob::~schema_blob() {
+#ifdef _WIN32
+    delete [] data;
+#else
+    munmap(data, size);
+#endif
+}
+
+// Functions are bound by the path of verb names from the root, separated by
+// spaces, so verbs and options that share a name can be bound separately.
+// Options in a group use "@" followed by the group name as their path.
+static std::string bindingKey(const std::string &path, const std::string &name) {
+    return path + '\n' + name;
+}
+static std::string verbPath(verb &v) {
+    std::string path;
+    for (verb *current = &v; current->parent != nullptr; current = current->parent)
+        path = path.empty() ? current->name : current->name + ' ' + path;
+    return path;
+}
+
+// A custom test bound by its description applies to every option using it,
+// unless the option has its own binding.
+void schema_blob::bindCustom(const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
+    customFns[desc] = evalFnPtr;
+}
+void schema_blob::bindCustom(const std::string &verbPath, const std::string &fullName, const std::string &desc, bool (*evalFnPtr)(const std::string&)) {
+    customFns[bindingKey(bindingKey(verbPath, fullName), desc)] = evalFnPtr;
+}
+void schema_blob::bindAction(const std::string &verbPath, void (*action)(verb *)) {
+    verbActions[verbPath] = action;
+}
+void schema_blob::bindAction(const std::string &verbPath, const std::string &fullName, void (*action)(option *)) {
+    optionActions[bindingKey(verbPath, fullName)] = action;
+}
+void schema_blob::bindDefault(const std::string &verbPath, const std::string &fullName, std::string (*defaultFn)()) {
+    defaultFns[bindingKey(verbPath, fullName)] = defaultFn;
+}
+
+const char *schema_blob::string(uint32_t offset) {
+    if (offset >= headerOf(data)->charsSize)
+        error("The schema is corrupt: string offset out of range\n");
+    return charsOf(data) + offset;
+}
+std::string schema_blob::programName() {
+    return string(headerOf(data)->programName);
+}
+std::string schema_blob::header() {
+    return string(headerOf(data)->header);
+}
+std::string schema_blob::footer() {
+    return string(headerOf(data)->footer);
+}
+std::string schema_blob::passThroughDelimiter() {
+    return string(headerOf(data)->passThroughDelimiter);
+}
+// computed from the whole tree when the blob was written
+uint64_t schema_blob::fingerprint() {
+    return headerOf(data)->fingerprintLow | (uint64_t)headerOf(data)->fingerprintHigh << 32;
+}
+
+// Returns nullptr when the criteria record is not valid
+test_criteria_base *schema_blob::createCriteria(uint32_t index, const std::string &optionKey) {
+    const blob_header *h = headerOf(data);
+    const blob_criteria &c = criteriaOf(data)[index];
+    if ((uint64_t)c.firstInt + c.intCount > h->intCount || (uint64_t)c.firstString + c.stringCount > h->stringCount)
+        return nullptr;
+    const int32_t *ints = intsOf(data) + c.firstInt;
+    const uint32_t *strings = stringsOf(data) + c.firstString;
+
+    switch ((CriteriaTypes)c.type) {
+    case CriteriaTypes::Criteria_custom: {
+        if (c.stringCount != 2)
+            break;
+        std::string desc = string(strings[1]);
+        auto fn = customFns.find(bindingKey(optionKey, desc));
+        if (fn == customFns.end())
+            fn = customFns.find(desc);
+        return &createCustom(string(strings[0]), desc, fn == customFns.end() ? nullptr : fn->second);
+    }
+    case CriteriaTypes::Criteria_type:
+        return &createTypeTest((TestTypes)c.param);
+    case CriteriaTypes::Criteria_number_list: {
+        number_list_test_criteria &test = createNumberList("");
+        for (uint32_t i = 0; i < c.intCount; i++)
+            test.add(ints[i]);
+        return &test;
+    }
+    case CriteriaTypes::Criteria_range:
+        if (c.intCount != 2)
+            break;
+        return &createRange(ints[0], ints[1]);
+    case CriteriaTypes::Criteria_number_range: {
+        if (c.param < 0 || (uint32_t)c.param > c.intCount || (c.intCount - c.param) % 2)
+            break;
+        number_range_test_criteria &test = createNumberRange();
+        for (int32_t i = 0; i < c.param; i++)
+            test.add(ints[i]);
+        for (uint32_t i = c.param; i < c.intCount; i += 2)
+            test.addRange(ints[i], ints[i+1]);
+        return &test;
+    }
+    case CriteriaTypes::Criteria_one_of_string: {
+        one_of_string_test_criteria &test = createOneOfString(c.param != 0);
+        for (uint32_t i = 0; i < c.stringCount; i++)
+            test.add(string(strings[i]));
+        return &test;
+    }
+    default:
+        break;
+    }
+    return nullptr;
+}
+
+option &schema_blob::createOption(uint32_t index, const std::string &path) {
+    const blob_option &o = optionsOf(data)[index];
+    if ((uint64_t)o.firstCriteria + o.criteriaCount > headerOf(data)->criteriaCount)
+        error("The schema is corrupt: option out of range\n");
+    option &opt = cpp_arg_parser::createOption(string(o.fullName), (char)o.chrName, string(o.desc), o.expectsValue, o.required);
+    opt.inherited = o.inherited;
+    std::string key = bindingKey(path, opt.fullName);
+    if (o.defaultFlags & optionLazyDefault) {
+        auto defaultFn = defaultFns.find(key);
+        opt.setDefault(defaultFn != defaultFns.end() ? defaultFn->second : nullptr, string(o.defaultDesc));
+    } else if (o.defaultFlags & optionDefault) {
+        opt.setDefault(string(o.defaultDesc));
+    }
+    auto optionAction = optionActions.find(key);
+    if (optionAction != optionActions.end())
+        opt.addAction(optionAction->second);
+    for (uint32_t i = o.firstCriteria; i < o.firstCriteria + o.criteriaCount; i++) {
+        test_criteria_base *test = createCriteria(i, key);
+        if (test == nullptr)
+            error("The schema is corrupt: invalid criteria\n");
+        opt.addTestCriteria(*test);
+    }
+    return opt;
+}
+
+// Returns nullptr when the constraint record is not valid
+constraint_base *schema_blob::createConstraint(uint32_t index) {
+    const blob_constraint &c = constraintsOf(data)[index];
+    if ((uint64_t)c.firstString + c.stringCount > headerOf(data)->stringCount || c.stringCount == 0)
+        return nullptr;
+    const uint32_t *strings = stringsOf(data) + c.firstString;
+
+    switch ((ConstraintTypes)c.type) {
+    case ConstraintTypes::Constraint_mutually_exclusive: {
+        mutually_exclusive_constraint &constraint = createMutuallyExclusive();
+        for (uint32_t i = 0; i < c.stringCount; i++)
+            constraint.add(string(strings[i]));
+        return &constraint;
+    }
+    case ConstraintTypes::Constraint_at_least_one: {
+        at_least_one_constraint &constraint = createAtLeastOne();
+        for (uint32_t i = 0; i < c.stringCount; i++)
+            constraint.add(string(strings[i]));
+        return &constraint;
+    }
+    case ConstraintTypes::Constraint_requires: {
+        requires_constraint &constraint = createRequires(string(strings[0]));
+        for (uint32_t i = 1; i < c.stringCount; i++)
+            constraint.add(string(strings[i]));
+        return &constraint;
+    }
+    default:
+        break;
+    }
+    return nullptr;
+}
+
+// Materialises the options and direct sub verbs of a verb. The sub verbs are
+// left unloaded until the parser enters them.
+void schema_blob::load(verb &v) {
+    const blob_header *h = headerOf(data);
+    if (v.blobIndex >= h->verbCount)
+        error("The schema is corrupt: verb out of range\n");
+    const blob_verb &record = verbsOf(data)[v.blobIndex];
+    if ((uint64_t)record.firstOption + record.optionCount > h->optionCount ||
+        (uint64_t)record.firstChild + record.childCount > h->verbCount ||
+        (uint64_t)record.firstConstraint + record.constraintCount > h->constraintCount)
+        error("The schema is corrupt: verb out of range\n");
+
+    std::string path = verbPath(v);
+    auto verbAction = verbActions.find(path);
+    if (verbAction != verbActions.end())
+        v.addAction(verbAction->second);
+
+    for (uint32_t i = record.firstOption; i < record.firstOption + record.optionCount; i++)
+        v.addOption(createOption(i, path));
+
+    // groups are shared by every verb that uses them, so are only created once
+    if ((uint64_t)record.firstGroupRef + record.groupRefCount > h->intCount)
+        error("The schema is corrupt: verb out of range\n");
+    for (uint32_t i = record.firstGroupRef; i < record.firstGroupRef + record.groupRefCount; i++) {
+        uint32_t index = (uint32_t)intsOf(data)[i];
+        if (index >= h->groupCount)
+            error("The schema is corrupt: option group out of range\n");
+        if (groups[index] == nullptr) {
+            const blob_group &g = groupsOf(data)[index];
+            if ((uint64_t)g.firstOption + g.optionCount > h->optionCount)
+                error("The schema is corrupt: option group out of range\n");
+            groups[index] = &createOptionGroup(string(g.name));
+            for (uint32_t j = g.firstOption; j < g.firstOption + g.optionCount; j++)
+                groups[index]->addOption(createOption(j, "@" + groups[index]->name));
+        }
+        v.addOptionGroup(*groups[index]);
+    }
+
+    for (uint32_t i = record.firstConstraint; i < record.firstConstraint + record.constraintCount; i++) {
+        constraint_base *constraint = createConstraint(i);
+        if (constraint == nullptr)
+            error("The schema is corrupt: invalid constraint\n");
+        v.addConstraint(*constraint);
+    }
+
+    for (uint32_t i = record.firstChild; i < record.firstChild + record.childCount; i++) {
+        const blob_verb &child = verbsOf(data)[i];
+        verb &sub = createVerb(string(child.name), string(child.desc));
+        sub.passThrough = child.flags & verbPassThrough;
+        sub.blob = this;
+        sub.blobIndex = i;
+        v.addVerb(sub);
+    }
+}
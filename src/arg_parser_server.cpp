@@ -0,0 +1,266 @@
+#include "arg_parser/arg_parser.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+#endif
+
+using namespace cpp_arg_parser;
+
+/* -------------------------------------------------------------------------- */
+/*                                  Protocol                                  */
+/* -------------------------------------------------------------------------- */
+// The client sends a request header carrying its stdin, stdout and stderr as
+// SCM_RIGHTS, followed by its working directory, argc arguments and envc
+// environment entries as NUL terminated strings. The server replies with the
+// exit status of the command.
+const uint32_t requestMagic = 0x41505343; // "APSC"
+const uint32_t maxPayloadSize = 1 << 22;
+const int forwardedFds = 3;
+
+struct request_header {
+    uint32_t magic;
+    uint32_t argc, envc;
+    uint32_t payloadSize;
+};
+
+#ifndef _WIN32
+static bool writeAll(int fd, const char *data, size_t size) {
+    while (size) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+static bool readAll(int fd, char *data, size_t size) {
+    while (size) {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+static bool openSocket(const std::string &socketPath, int &fd, sockaddr_un &addr) {
+    if (socketPath.size() >= sizeof(addr.sun_path))
+        return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    return fd >= 0;
+}
+#endif
+
+/* -------------------------------------------------------------------------- */
+/*                                   Server                                   */
+/* -------------------------------------------------------------------------- */
+#ifndef _WIN32
+// Runs in a process forked for the connection. The command itself runs in a
+// further child so that the exit status, including exits from error(), can be
+// reported back to the client.
+void arg_parser::handleRequest(int client, void (*requestFn)(arg_parser *)) {
+    request_header header;
+    int fds[forwardedFds];
+    char control[CMSG_SPACE(sizeof(fds))];
+    iovec iov = { &header, sizeof(header) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(client, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n != sizeof(header) || header.magic != requestMagic || header.payloadSize > maxPayloadSize ||
+        cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+        _exit(1);
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    std::vector<char> payload(header.payloadSize + 1);
+    if (!readAll(client, payload.data(), header.payloadSize))
+        _exit(1);
+    payload[header.payloadSize] = '\0';
+
+    // split the payload back into the working directory, argv and the environment
+    std::vector<char*> args, env;
+    char *p = payload.data(), *end = payload.data() + header.payloadSize;
+    const char *cwd = p;
+    p += strlen(p) + 1;
+    for (uint32_t i = 0; i < header.argc + header.envc; i++) {
+        if (p >= end)
+            _exit(1);
+        (i < header.argc ? args : env).push_back(p);
+        p += strlen(p) + 1;
+    }
+    if (args.empty())
+        _exit(1);
+    args.push_back(nullptr);
+    env.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(client);
+        for (int i = 0; i < forwardedFds; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        // relative paths in the command resolve against the client's directory
+        if (cwd[0] != '\0' && chdir(cwd) != 0)
+            error("Failed to change to the working directory: %s\n", cwd);
+        environ = env.data();
+        parse((int)args.size() - 1, args.data());
+        if (requestFn != nullptr)
+            requestFn(this);
+        exit(0);
+    }
+    for (int fd : fds)
+        close(fd);
+
+    int32_t status = 1;
+    int wstatus;
+    if (pid > 0) {
+        while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR);
+        if (WIFEXITED(wstatus))
+            status = WEXITSTATUS(wstatus);
+        else if (WIFSIGNALED(wstatus))
+            status = 128 + WTERMSIG(wstatus);
+    }
+    writeAll(client, (const char*)&status, sizeof(status));
+    _exit(0);
+}
+
+void arg_parser::serve(const std::string &socketPath, void (*requestFn)(arg_parser *)) {
+    int listener;
+    sockaddr_un addr;
+    if (!openSocket(socketPath, listener, addr))
+        error("Failed to create the server socket: %s\n", socketPath);
+
+    // a socket left behind by a server that has exited is replaced, but not a
+    // live server's socket or anything that is not a socket
+    struct stat st;
+    if (lstat(socketPath.c_str(), &st) == 0) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = !S_ISSOCK(st.st_mode) || probe < 0 || connect(probe, (sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live)
+            error("The server socket path is already in use: %s\n", socketPath);
+        unlink(socketPath.c_str());
+    }
+
+    // only the owner may connect, as requests run with the server's privileges
+    mode_t mask = umask(0177);
+    int bound = bind(listener, (sockaddr*)&addr, sizeof(addr));
+    umask(mask);
+    if (bound != 0 || listen(listener, 64) != 0)
+        error("Failed to listen on the server socket: %s\n", socketPath);
+
+    // connection processes are reaped automatically
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error("Failed to accept a connection: %s\n", strerror(errno));
+        }
+
+        // flush so buffered output is not duplicated into the child
+        fflush(nullptr);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            signal(SIGCHLD, SIG_DFL);
+            handleRequest(client, requestFn);
+        }
+        close(client);
+    }
+}
+
+int cpp_arg_parser::forwardToServer(const std::string &socketPath, int argc, char **argv) {
+    std::string payload;
+    char cwd[PATH_MAX];
+    payload.append(getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : "");
+    payload += '\0';
+    request_header header = {};
+    header.magic = requestMagic;
+    header.argc = argc;
+    for (int i = 0; i < argc; i++)
+        payload.append(argv[i], strlen(argv[i]) + 1);
+    for (char **e = environ; *e != nullptr; e++, header.envc++)
+        payload.append(*e, strlen(*e) + 1);
+
+    // a request the server would reject is run locally by the caller instead
+    if (payload.size() > maxPayloadSize)
+        return -1;
+    header.payloadSize = (uint32_t)payload.size();
+
+    int fd;
+    sockaddr_un addr;
+    if (!openSocket(socketPath, fd, addr))
+        return -1;
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int fds[forwardedFds] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov = { &header, sizeof(header) };
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status = 1;
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(header) ||
+        !writeAll(fd, payload.data(), payload.size()) ||
+        !readAll(fd, (char*)&status, sizeof(status)))
+        status = 1;
+    close(fd);
+    return status;
+}
+#else
+void arg_parser::handleRequest(int client, void (*requestFn)(arg_parser *)) {
+}
+void arg_parser::serve(const std::string &socketPath, void (*requestFn)(arg_parser *)) {
+    error("The server mode is not supported on this platform\n");
+}
+int cpp_arg_parser::forwardToServer(const std::string &socketPath, int argc, char **argv) {
+    return -1;
+}
+#endif
@@ -0,0 +1,393 @@
+#include "arg_parser/arg_parser.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cerrno>
+#include <iostream>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <termios.h>
+#include <sys/wait.h>
+#endif
+
+using namespace cpp_arg_parser;
+
+const std::string escapeWord = "--";
+const size_t maxHistory = 500;
+
+static bool startsWith(const std::string &str, const std::string &prefix) {
+    return str.compare(0, prefix.size(), prefix) == 0;
+}
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                Line analyser                               */
+/* -------------------------------------------------------------------------- */
+line_analyser::line_analyser(verb *root, const std::string &delimiter) {
+    this->root = root;
+    this->delimiter = delimiter;
+    root->load();
+}
+
+line_token line_analyser::initial() {
+    line_token state;
+    state.start = state.end = 0;
+    state.v = root;
+    state.inVerbs = true;
+    state.seenCount = 0;
+    return state;
+}
+
+// Follows the same rules as event_reader::next, one word at a time
+void line_analyser::step(line_token &state, const std::string &word) {
+    if (state.message != nullptr || state.passThrough)
+        return;
+    if (state.pending != nullptr) {
+        if (!state.escaped && word == escapeWord) {
+            state.escaped = true;
+        } else if (state.escaped || word.empty() || word[0] != '-') {
+            state.pending = nullptr;
+            state.escaped = false;
+        } else {
+            state.message = "A required argument was not present for the option";
+        }
+        return;
+    }
+    if (state.escaped) { // escaped positional argument
+        state.escaped = false;
+        return;
+    }
+    if (delimiter != "" && word == delimiter) {
+        state.passThrough = true;
+        return;
+    }
+    if (word.empty() || word[0] != '-') {
+        if (state.inVerbs) {
+            auto child = state.v->verbsMap.find(word);
+            if (child != state.v->verbsMap.end()) {
+                state.v = child->second;
+                state.v->load();
+                return;
+            }
+        }
+        if (state.v->passThrough)
+            state.passThrough = true;
+        else if (state.inVerbs)
+            state.message = "The provided verb was not recognised";
+        return;
+    }
+    state.inVerbs = false;
+
+    if (word == escapeWord) {
+        state.escaped = true;
+        return;
+    }
+    if (word == "-?" || word == "--help" || word == "--verbs")
+        return;
+
+    option *match = state.v->findOption(word);
+    if (match == nullptr) {
+        if (state.v->passThrough)
+            state.passThrough = true;
+        else
+            state.message = "Unrecognised option";
+        return;
+    }
+    if (std::find(seen.begin(), seen.end(), match) != seen.end()) {
+        state.message = "Multiple occurances of an option";
+        return;
+    }
+    seen.push_back(match);
+    state.seenCount = seen.size();
+    if (match->expectsValue)
+        state.pending = match;
+}
+
+// Tokens that end before the first changed character keep their state, so
+// only the tail of the line is split and analysed again.
+void line_analyser::update(const std::string &newLine) {
+    size_t common = 0;
+    while (common < line.size() && common < newLine.size() && line[common] == newLine[common])
+        common++;
+    size_t keep = 0;
+    while (keep < tokens.size() && tokens[keep].end < common)
+        keep++;
+    tokens.resize(keep);
+    words.resize(keep);
+
+    line_token state = keep ? tokens.back() : initial();
+    seen.resize(state.seenCount);
+    line = newLine;
+
+    size_t i = state.end;
+    for (;;) {
+        while (i < line.size() && isSpace(line[i]))
+            i++;
+        if (i >= line.size())
+            break;
+
+        // quotes group words, but are not part of them
+        std::string word;
+        size_t start = i;
+        char quote = '\0';
+        for (; i < line.size() && (quote || !isSpace(line[i])); i++) {
+            if (quote && line[i] == quote)
+                quote = '\0';
+            else if (!quote && (line[i] == '"' || line[i] == '\''))
+                quote = line[i];
+            else
+                word += line[i];
+        }
+        step(state, word);
+        state.start = start;
+        state.end = i;
+        tokens.push_back(state);
+        words.push_back(word);
+    }
+}
+
+const std::vector<std::string> &line_analyser::args() {
+    return words;
+}
+
+// Returns the first error on the line, if any. A word that is still being
+// typed is not reported, as it may yet become valid.
+const char *line_analyser::message(size_t &position) {
+    if (tokens.empty() || tokens.back().message == nullptr)
+        return nullptr;
+    size_t i = 0;
+    while (tokens[i].message == nullptr)
+        i++;
+    if (i + 1 == tokens.size() && tokens[i].end == line.size())
+        return nullptr;
+    position = tokens[i].start;
+    return tokens[i].message;
+}
+
+verb *line_analyser::current() {
+    return tokens.empty() ? root : tokens.back().v;
+}
+
+void line_analyser::addOptionHints(verb *v, const std::string &prefix, size_t seenCount, std::vector<std::string> &hints) {
+    const std::string &from = prefix.size() < escapeWord.size() ? escapeWord : prefix;
+    auto addFrom = [&](std::map<std::string, option*, std::less<>> &optionsMap, bool own) {
+        for (auto it = optionsMap.lower_bound(from); it != optionsMap.end() && startsWith(it->first, from); ++it) {
+            // skip inherited options that are shadowed, and options already given
+            if (!(own || it->second->inherited) || v->findOption(it->first) != it->second ||
+                std::find(seen.begin(), seen.begin() + seenCount, it->second) != seen.begin() + seenCount)
+                continue;
+            hints.push_back(it->first);
+        }
+    };
+    for (verb *current = v; current != nullptr; current = current->parent) {
+        addFrom(current->optionsMap, current == v);
+        for (option_group *group : current->groups)
+            addFrom(group->optionsMap, current == v);
+    }
+}
+
+// Lists the words that may follow, or complete the word being typed
+void line_analyser::hints(std::vector<std::string> &hints) {
+    hints.clear();
+    bool typing = !tokens.empty() && tokens.back().end == line.size();
+    size_t base = tokens.size() - (typing ? 1 : 0);
+    line_token state = base ? tokens[base - 1] : initial();
+    std::string prefix = typing ? words.back() : "";
+    if (state.message != nullptr || state.passThrough)
+        return;
+
+    if (state.pending != nullptr) {
+        for (test_criteria_base *test : state.pending->testCriteria) {
+            criteria_data data;
+            if (!test->serialize(data))
+                continue;
+            if (data.type == CriteriaTypes::Criteria_one_of_string)
+                for (const std::string &str : data.strings)
+                    if (startsWith(str, prefix))
+                        hints.push_back(str);
+            if (data.type == CriteriaTypes::Criteria_number_list || data.type == CriteriaTypes::Criteria_number_range) {
+                size_t count = data.type == CriteriaTypes::Criteria_number_list ? data.ints.size() : (size_t)data.param;
+                for (size_t i = 0; i < count; i++)
+                    if (startsWith(std::to_string(data.ints[i]), prefix))
+                        hints.push_back(std::to_string(data.ints[i]));
+            }
+        }
+    } else if (!state.escaped) {
+        if (state.inVerbs && (prefix.empty() || prefix[0] != '-'))
+            for (auto it = state.v->verbsMap.lower_bound(prefix); it != state.v->verbsMap.end() && startsWith(it->first, prefix); ++it)
+                hints.push_back(it->first);
+        if (prefix.empty() || prefix[0] == '-')
+            addOptionHints(state.v, prefix, state.seenCount, hints);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                                    Shell                                   */
+/* -------------------------------------------------------------------------- */
+#ifndef _WIN32
+// Commands run in a child process, so that errors exiting through error()
+// return to the prompt.
+int arg_parser::runCommand(const std::vector<std::string> &args, void (*commandFn)(arg_parser *)) {
+    fflush(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(programName.c_str()));
+        for (const std::string &arg : args)
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        parse((int)argv.size() - 1, argv.data());
+        if (commandFn != nullptr)
+            commandFn(this);
+        exit(0);
+    }
+    int wstatus, status = 1;
+    if (pid > 0) {
+        while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR);
+        if (WIFEXITED(wstatus))
+            status = WEXITSTATUS(wstatus);
+        else if (WIFSIGNALED(wstatus))
+            status = 128 + WTERMSIG(wstatus);
+    }
+    return status;
+}
+
+static void redraw(const std::string &prompt, const std::string &line, size_t cursor, line_analyser &analyser) {
+    size_t position;
+    const char *message = analyser.message(position);
+    printf("\r%s%s\x1b[K", prompt.c_str(), line.c_str());
+    if (message != nullptr)
+        printf("  \x1b[31m%s (column %zu)\x1b[0m", message, position + 1);
+    printf("\r");
+    if (prompt.size() + cursor)
+        printf("\x1b[%zuC", prompt.size() + cursor);
+    fflush(stdout);
+}
+
+// Completes the word being typed when there is one hint, otherwise lists them
+static void complete(std::string &line, size_t &cursor, line_analyser &analyser) {
+    std::vector<std::string> hints;
+    analyser.hints(hints);
+    if (hints.size() == 1) {
+        size_t start = line.size();
+        while (start > 0 && !isSpace(line[start - 1]))
+            start--;
+        line.replace(start, std::string::npos, hints[0] + " ");
+        cursor = line.size();
+        analyser.update(line);
+    } else if (hints.size() > 1) {
+        printf("\r\n");
+        for (const std::string &hint : hints)
+            printf("%s  ", hint.c_str());
+        printf("\r\n");
+    }
+}
+
+// A minimal line editor, supporting the arrow keys, backspace, tab
+// completion and history. Returns false at the end of input.
+static bool readLine(const std::string &prompt, std::string &line, std::vector<std::string> &history, line_analyser &analyser) {
+    size_t cursor = 0, historyIndex = history.size();
+    line.clear();
+    analyser.update(line);
+    redraw(prompt, line, cursor, analyser);
+
+    char c;
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || (c == 4 && line.empty())) // ctrl-d
+            return false;
+
+        if (c == '\r' || c == '\n') {
+            printf("\r\n");
+            return true;
+        } else if (c == 3) { // ctrl-c
+            line.clear();
+            cursor = 0;
+            printf("^C\r\n");
+        } else if (c == '\t') {
+            complete(line, cursor, analyser);
+        } else if ((c == 127 || c == 8) && cursor > 0) {
+            line.erase(--cursor, 1);
+        } else if (c == '\x1b') {
+            char seq[2];
+            if (read(STDIN_FILENO, seq, 2) != 2 || seq[0] != '[')
+                continue;
+            if (seq[1] == 'A' && historyIndex > 0)
+                line = history[--historyIndex];
+            else if (seq[1] == 'B' && historyIndex < history.size())
+                line = ++historyIndex < history.size() ? history[historyIndex] : "";
+            else if (seq[1] == 'C' && cursor < line.size())
+                cursor++;
+            else if (seq[1] == 'D' && cursor > 0)
+                cursor--;
+            if (seq[1] == 'A' || seq[1] == 'B')
+                cursor = line.size();
+        } else if (isprint((unsigned char)c)) {
+            line.insert(cursor++, 1, c);
+        }
+        analyser.update(line);
+        redraw(prompt, line, cursor, analyser);
+    }
+}
+
+void arg_parser::shell(const std::string &prompt, void (*commandFn)(arg_parser *)) {
+    root->load();
+    if (programName == "")
+        programName = root->name;
+    line_analyser analyser = this->analyser();
+    std::string line;
+
+    // without a terminal, each line of the input is run as a command
+    if (!isatty(STDIN_FILENO)) {
+        while (std::getline(std::cin, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            analyser.update(line);
+            if (!analyser.args().empty())
+                runCommand(analyser.args(), commandFn);
+        }
+        return;
+    }
+
+    termios original, raw;
+    if (tcgetattr(STDIN_FILENO, &original) != 0)
+        error("Failed to read the terminal settings\n");
+    raw = original;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_oflag &= ~OPOST;
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+
+    std::vector<std::string> history;
+    for (;;) {
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+        bool more = readLine(prompt, line, history, analyser);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &original);
+        if (!more)
+            break;
+        if (analyser.args().empty())
+            continue;
+
+        if (history.empty() || history.back() != line)
+            history.push_back(line);
+        if (history.size() > maxHistory)
+            history.erase(history.begin());
+        runCommand(analyser.args(), commandFn);
+    }
+    printf("\n");
+}
+#else
+int arg_parser::runCommand(const std::vector<std::string> &args, void (*commandFn)(arg_parser *)) {
+    return -1;
+}
+void arg_parser::shell(const std::string &prompt, void (*commandFn)(arg_parser *)) {
+    error("The shell mode is not supported on this platform\n");
+}
+#endif
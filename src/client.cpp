@@ -0,0 +1,16 @@
+#include "arg_parser/arg_parser.hpp"
+
+// forwards the remaining arguments to a server started with arg_parser::serve
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("Usage: %s <socket> [args]\n", argv[0]);
+        return 1;
+    }
+
+    int status = cpp_arg_parser::forwardToServer(argv[1], argc - 1, argv + 1);
+    if (status < 0) {
+        printf("No server is listening on: %s\n", argv[1]);
+        return 1;
+    }
+    return status;
+}
@@ -0,0 +1,49 @@
+#include "arg_parser/arg_parser.hpp"
+
+using namespace cpp_arg_parser;
+
+void buildSchema(arg_parser &argParser) {
+    argParser
+        .setProgramName("crypto")
+        .setHelpHeader(
+            "\nWelcome to the crypto cli, an application for using and solving\n"
+            "classical and modern ciphers. See below for how to use.")
+        .setHelpFooter("\nFooter\n")
+        .addOption(createOption("cipher", 'c', "The cipher to use", true, true)
+            .addTestCriteria(createOneOfString(false)
+                .add("affine")
+                .add("atbash")
+                .add("caesar"))
+            .addTestCriteria(createTypeTest(TestTypes::Test_string)))
+        .addOption(createOption("mode", 'm', "The mode to use", true, true)
+            .addTestCriteria(createOneOfString(false)
+                .add("encrypt")
+                .add("decrypt")
+                .add("solve")
+                .add("analyse")))
+        .addOption(createOption("action", '\0', "Run a test action", false, false))
+        .addOption(createOption("nopunc", '\0', "Don't store the punctuation", false, false))
+        .addOption(createOption("key",    'k', "Pass the key argument to the cipher", true, false))
+        .addOption(createOption("verbose",'v', "Show everything", false, false)
+            .setInherited())
+        .addOption(createOption("number", 'n', "A test to pass a number", true, false)
+            .addTestCriteria(createNumberRange()
+                .addRange(10, 20)
+                .add(7)))
+        // the default is computed by a function bound when the schema is loaded
+        .addOption(createOption("threads",'t', "The number of threads to use", true, false)
+            .setInherited()
+            .setDefault(nullptr, "the number of cores"))
+        .addConstraint(createMutuallyExclusive()
+            .add("key")
+            .add("nopunc"))
+        .addVerb(createVerb("submodule", "desc")
+            .addOption(createOption("someOption", '\0', "description", false, false))
+            .addOption(createOption("someOtherOption", 's', "desc", true, false)
+                .addTestCriteria(createNumberList("someOtherOption")
+                    .add(1)
+                    .add(2)
+                    .add(50)))
+            .addVerb(createVerb("some-verb", "some desc")))
+        .addVerb(createVerb("verbname", "verbdesc"));
+}
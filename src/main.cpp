@@ -1,5 +1,6 @@
 #include "arg_parser/arg_parser.hpp"
 #include <iostream>
+#include <thread>
 
 using namespace cpp_arg_parser;
 
@@ -11,46 +12,19 @@ void action(cpp_arg_parser::option *opt) {
     printf("Option name: %s\n", cpp_arg_parser::getFullName(opt->fullName).c_str());
 }
 
+std::string hardwareThreads() {
+    return std::to_string(std::thread::hardware_concurrency());
+}
+
 int main(int argc, char **argv) {
     cpp_arg_parser::arg_parser argParser;
 
+    // the schema is built by arg_parser_schema_gen from demo_schema.cpp
     argParser
-        .setProgramName("crypto")
-        .setHelpHeader(
-            "\nWelcome to the crypto cli, an application for using and solving\n"
-            "classical and modern ciphers. See below for how to use.")
-        .setHelpFooter("\nFooter\n")
-        .addOption(createOption("cipher", 'c', "The cipher to use", true, true)
-            .addTestCriteria(createOneOfString(false)
-                .add("affine")
-                .add("atbash")
-                .add("caesar"))
-            .addTestCriteria(createTypeTest(TestTypes::Test_string)))
-        .addOption(createOption("mode", 'm', "The mode to use", true, true)
-            .addTestCriteria(createOneOfString(false)
-                .add("encrypt")
-                .add("decrypt")
-                .add("solve")
-                .add("analyse")))
-        .addOption(createOption("action", '\0', "Run a test action", false, false)
-            .addAction(action))
-        .addOption(createOption("nopunc", '\0', "Don't store the punctuation", false, false))
-        .addOption(createOption("key",    'k', "Pass the key argument to the cipher", true, false))
-        .addOption(createOption("verbose",'v', "Show everything", false, false))
-        .addOption(createOption("number", 'n', "A test to pass a number", true, false)
-            .addTestCriteria(createNumberRange()
-                .addRange(10, 20)
-                .add(7)))
-        .addVerb(createVerb("submodule", "desc")
-            .addOption(createOption("someOption", '\0', "description", false, false))
-            .addOption(createOption("someOtherOption", 's', "desc", true, false)
-                .addTestCriteria(createNumberList("someOtherOption")
-                    .add(1)
-                    .add(2)
-                    .add(50)))
-            .addVerb(createVerb("some-verb", "some desc"))
-                .addAction(vAction))
-        .addVerb(createVerb("verbname", "verbdesc"));
+        .loadSchema(DEMO_SCHEMA_PATH)
+        .bindVerbAction("submodule", vAction)
+        .bindOptionAction("action", action)
+        .bindOptionDefault("threads", hardwareThreads);
     
     argParser.parse(argc, argv);
 
@@ -62,6 +36,7 @@ int main(int argc, char **argv) {
         printf("number: %s\n", argParser.getString("number").c_str());
         printf("%d\n", argParser.get<int>("number"));
     }
+    printf("threads: %d\n", argParser.get<int>("threads"));
 
 
     return 0;
@@ -0,0 +1,17 @@
+#include "arg_parser/arg_parser.hpp"
+
+// provided by the schema being compiled
+void buildSchema(cpp_arg_parser::arg_parser &argParser);
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s <output file>\n", argv[0]);
+        return 1;
+    }
+
+    cpp_arg_parser::arg_parser argParser;
+    buildSchema(argParser);
+    argParser.writeSchema(argv[1]);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "arg_parser/arg_parser.hpp"
+
+#include <cstdlib>
+#include <new>
+
+using namespace cpp_arg_parser;
+
+// provided by the schema being tested
+void buildSchema(arg_parser &argParser);
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept {
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+// Parses the same command lines repeatedly, failing if any parse after the
+// first few allocates.
+int main() {
+    arg_parser argParser;
+    buildSchema(argParser);
+    // values longer than the small string buffer must not be copied either
+    argParser.addOption(createOption("format", 'f', "The output format", true, false)
+        .addTestCriteria(createOneOfString(false)
+            .add("comma-separated-values")));
+
+    char *rootArgs[] = {
+        (char*)"crypto", (char*)"-c", (char*)"caesar", (char*)"-m", (char*)"encrypt",
+        (char*)"-n", (char*)"15", (char*)"-k", (char*)"a-key-longer-than-the-buffer", (char*)"-v",
+        (char*)"-f", (char*)"Comma-Separated-Values", nullptr
+    };
+    char *verbArgs[] = {
+        (char*)"crypto", (char*)"submodule", (char*)"-s", (char*)"50", (char*)"--someOption", nullptr
+    };
+
+    long total = 0;
+    size_t before = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (i == 10)
+            before = allocations;
+        argParser.parse(12, rootArgs);
+        total += argParser.get<int>("number") + argParser.getString("cipher").size() + argParser.getString("format").size();
+        argParser.parse(5, verbArgs);
+        total += argParser.get<int>('s');
+    }
+
+    size_t count = allocations - before;
+    printf("%zu allocations in the steady state (checksum %ld)\n", count, total);
+    return count == 0 ? 0 : 1;
+}